@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <xxtea.h>
+
+// Microbenchmark for the XXTEA block functions. Every implementation the
+// CPU supports is first checked bit-exact against xxtea_encrypt() and
+// xxtea_decrypt() on random data and keys, then timed on batches of
+// packet sized blocks. The per-packet xxtea_encrypt() path, allocations
+// included, is timed as the baseline.
+
+#define DEFAULT_BATCH 64
+#define DEFAULT_BYTES 12    // One event, as the server sends it
+#define DEFAULT_SECS  1
+#define CHECK_ROUNDS  200
+#define KEY_BYTES     17    // xxtea_encrypt() reads 16, plus a terminator
+
+static const char *impls[] = { "scalar", "sse2", "vector", "avx2" };
+
+static void show_usage(const char *arg0)
+{
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: %s [-n <blocks>] [-b <bytes>] [-d <secs>] [-I <impl>]\n", arg0);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         Checks the XXTEA block functions against xxtea_encrypt() and\n");
+  fprintf(stderr, "         xxtea_decrypt(), then reports blocks per second.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         -n <blocks>  : Blocks per batch, default %d.\n", DEFAULT_BATCH);
+  fprintf(stderr, "         -b <bytes>   : Plaintext bytes per block, default %d. Packets\n", DEFAULT_BYTES);
+  fprintf(stderr, "                        with extensions are up to 62.\n");
+  fprintf(stderr, "         -d <secs>    : Time each implementation for <secs> seconds,\n");
+  fprintf(stderr, "                        default %d.\n", DEFAULT_SECS);
+  fprintf(stderr, "         -I <impl>    : Only check and time <impl>: scalar, sse2,\n");
+  fprintf(stderr, "                        vector or avx2.\n");
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Random key strings of 0 to 16 characters, some without terminator
+// inside the 16 bytes xxtea_encrypt() looks at.
+static void random_keys(char *keys, uint32_t *fixed, int num)
+{
+  for (int b = 0; b < num; b++) {
+    char *key = &keys[b * KEY_BYTES];
+    int len = random() % 17;
+    memset(key, 0, KEY_BYTES);
+    for (int i = 0; i < len; i++) key[i] = 1 + random() % 255;
+    xxtea_fix_key(key, &fixed[b * 4]);
+  }
+}
+
+// Blocks laid out like xxtea_encrypt() lays out its input.
+static void random_blocks(uint8_t *plain, uint32_t *blocks, int num, int bytes, int words)
+{
+  for (int b = 0; b < num; b++) {
+    uint8_t *p = &plain[b * bytes];
+    uint32_t *w = &blocks[b * words];
+    for (int i = 0; i < bytes; i++) p[i] = random();
+    memset(w, 0, words * sizeof(uint32_t));
+    for (int i = 0; i < bytes; i++) w[i >> 2] |= (uint32_t)p[i] << ((i & 3) << 3);
+    w[words - 1] = bytes;
+  }
+}
+
+static int block_equals(uint32_t *w, uint8_t *bytes, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    if ((uint8_t)(w[i >> 2] >> ((i & 3) << 3)) != bytes[i]) return 0;
+  }
+  return 1;
+}
+
+static int check(int num, int bytes, int words)
+{
+  uint8_t  *plain  = malloc(num * bytes);
+  uint32_t *blocks = malloc(num * words * sizeof(uint32_t));
+  char     *keys   = malloc(num * KEY_BYTES);
+  uint32_t *fixed  = malloc(num * 4 * sizeof(uint32_t));
+  int ok = 1;
+
+  for (int round = 0; round < CHECK_ROUNDS && ok; round++) {
+    // Odd batch sizes leave lanes empty.
+    int n = 1 + random() % num;
+    random_keys(keys, fixed, n);
+    random_blocks(plain, blocks, n, bytes, words);
+
+    xxtea_encrypt_blocks(blocks, words, n, fixed);
+    for (int b = 0; b < n && ok; b++) {
+      size_t len;
+      uint8_t *ref = xxtea_encrypt(&plain[b * bytes], bytes, &keys[b * KEY_BYTES], &len);
+      if (!ref || len != words * sizeof(uint32_t) || !block_equals(&blocks[b * words], ref, len)) {
+        fprintf(stderr, "%s: encrypted block %d of %d differs from xxtea_encrypt()\n", xxtea_batch_impl(), b, n);
+        ok = 0;
+      }
+      free(ref);
+    }
+    if (!ok) break;
+
+    uint8_t *cipher = malloc(n * words * sizeof(uint32_t));
+    for (int b = 0; b < n; b++) {
+      for (int i = 0; i < words * 4; i++) cipher[b * words * 4 + i] = blocks[b * words + (i >> 2)] >> ((i & 3) << 3);
+    }
+    xxtea_decrypt_blocks(blocks, words, n, fixed);
+    for (int b = 0; b < n && ok; b++) {
+      size_t len;
+      uint8_t *ref = xxtea_decrypt(&cipher[b * words * 4], words * 4, &keys[b * KEY_BYTES], &len);
+      if (!ref || len != (size_t)bytes || blocks[b * words + words - 1] != (uint32_t)bytes
+          || !block_equals(&blocks[b * words], ref, len) || memcmp(ref, &plain[b * bytes], bytes) != 0) {
+        fprintf(stderr, "%s: decrypted block %d of %d differs from xxtea_decrypt()\n", xxtea_batch_impl(), b, n);
+        ok = 0;
+      }
+      free(ref);
+    }
+    free(cipher);
+  }
+
+  free(plain);
+  free(blocks);
+  free(keys);
+  free(fixed);
+  return ok;
+}
+
+static void report(const char *name, const char *what, uint64_t blocks, int bytes, double secs)
+{
+  printf("%-8s %-8s %12.0f blocks/s %9.1f MB/s\n", name, what, blocks / secs, blocks * bytes / secs / 1e6);
+}
+
+static void bench(const char *name, int num, int bytes, int words, int secs)
+{
+  uint8_t  *plain  = malloc(num * bytes);
+  uint32_t *blocks = malloc(num * words * sizeof(uint32_t));
+  char     *keys   = malloc(num * KEY_BYTES);
+  uint32_t *fixed  = malloc(num * 4 * sizeof(uint32_t));
+  random_keys(keys, fixed, num);
+  random_blocks(plain, blocks, num, bytes, words);
+
+  for (int decrypt = 0; decrypt < 2; decrypt++) {
+    uint64_t done = 0;
+    double start = now_s(), elapsed;
+    do {
+      for (int i = 0; i < 64; i++) {
+        if (decrypt) xxtea_decrypt_blocks(blocks, words, num, fixed);
+        else xxtea_encrypt_blocks(blocks, words, num, fixed);
+      }
+      done += 64 * num;
+      elapsed = now_s() - start;
+    } while (elapsed < secs);
+    report(name, decrypt ? "decrypt" : "encrypt", done, bytes, elapsed);
+  }
+
+  free(plain);
+  free(blocks);
+  free(keys);
+  free(fixed);
+}
+
+// What a sender does today: one allocating call per packet.
+static void bench_reference(int bytes, int secs)
+{
+  uint8_t plain[XXTEA_MAX_WORDS * 4];
+  char key[KEY_BYTES] = "benchmark key";
+  uint64_t done = 0;
+  double start = now_s(), elapsed;
+  for (int i = 0; i < bytes; i++) plain[i] = random();
+
+  do {
+    for (int i = 0; i < 1024; i++) {
+      size_t len;
+      free(xxtea_encrypt(plain, bytes, key, &len));
+    }
+    done += 1024;
+    elapsed = now_s() - start;
+  } while (elapsed < secs);
+  report("xxtea", "encrypt", done, bytes, elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+  int num   = DEFAULT_BATCH;
+  int bytes = DEFAULT_BYTES;
+  int secs  = DEFAULT_SECS;
+  const char *only = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:d:I:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num = atoi(optarg);
+      if (num < 1) show_usage(argv[0]);
+      break;
+    case 'b':
+      bytes = atoi(optarg);
+      if (bytes < 1) show_usage(argv[0]);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      if (secs < 1) show_usage(argv[0]);
+      break;
+    case 'I':
+      only = optarg;
+      break;
+    default:
+      show_usage(argv[0]);
+    }
+  }
+  if (optind < argc) show_usage(argv[0]);
+
+  // The data words plus the length word xxtea_encrypt() appends
+  int words = (bytes + 3) / 4 + 1;
+  if (words > XXTEA_MAX_WORDS) {
+    fprintf(stderr, "At most %d bytes per block\n", (XXTEA_MAX_WORDS - 1) * 4);
+    exit(1);
+  }
+
+  srandom(time(NULL) ^ getpid());
+  printf("Dispatch picks %s. %d blocks of %d bytes per batch, %d words.\n",
+    xxtea_batch_impl(), num, bytes, words);
+
+  int failed = 0, tried = 0;
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (only && strcmp(only, impls[i]) != 0) continue;
+    if (!xxtea_batch_force(impls[i])) continue;
+    tried++;
+    if (!check(num, bytes, words)) {
+      failed = 1;
+      continue;
+    }
+    printf("%-8s matches xxtea_encrypt()/xxtea_decrypt()\n", impls[i]);
+  }
+  if (!tried) {
+    fprintf(stderr, "No such implementation on this CPU: %s\n", only);
+    exit(1);
+  }
+  if (failed) exit(1);
+
+  printf("\n");
+  if (!only) bench_reference(bytes, secs);
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (only && strcmp(only, impls[i]) != 0) continue;
+    if (xxtea_batch_force(impls[i])) bench(impls[i], num, bytes, words, secs);
+  }
+  return 0;
+}
@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -13,9 +19,48 @@
 
 #define DEFAULT_MULTICAST_GROUP "239.255.77.88"
 #define DEFAULT_PORT 4020
+#define DEFAULT_ANNOUNCE_MS 1000
+
+// Presence announcements go to the group on port + 1
+#define PRESENCE_TYPE 0xfe00
+
+// Low 16 bits of rnd carry the server's ms clock
+#define STAMP_MASK 0xffff
+
+// Key log extension, see keylog_receive()
+#define EXT_KEYLOG 1
+#define KEYLOG_WINDOW 64
+
+// Mirrored devices, see device_message()
+#define EXT_DEVICE  2
+#define TYPE_DEVICE 0xfe01
+#define MAX_SLOTS   253     // High bytes 0xfe and 0xff are control types
+
+#define DEV_INFO    1
+#define DEV_BITS    2
+#define DEV_ABS     3
+#define DEV_PROPS   4
+#define DEV_COMMIT  5
+
+// Touch slot changes of mirrored touchpads, see mt_frame()
+#define EXT_MTFRAME  3
+#define TYPE_MTFRAME 0xfe02
+
+// Client IDs from here up address groups, see -G
+#define GROUP_BASE 224
+#define MAX_GROUPS 32
+
+// Shared memory ring from a server on this host, see shm_attach()
+#define SHM_MAGIC 0x314d4853
+#define SHM_SLOTS 1024
+
+#define JITTER_FRAMES 64
+#define JITTER_EVENTS 8
 
 #define MIN_PACKET_SIZE 14
 #define MAX_PACKET_SIZE 18
+// Packets with payload extensions are larger
+#define MAX_DATAGRAM_SIZE 64
 
 struct __attribute__((__packed__)) em_packet {
     // Sent unencrypted
@@ -30,20 +75,173 @@ struct __attribute__((__packed__)) em_packet {
     uint32_t                _space_;    // 4
 } em_packet;
 
+struct __attribute__((__packed__)) em_ext_header {
+  uint8_t                 type;
+  uint8_t                 len;        // Including this header
+  uint16_t                seq;        // Key sequence of the event, 0 if none
+};
+
+struct __attribute__((__packed__)) em_keylog_entry {
+  uint16_t                seq;
+  uint16_t                code;
+  uint8_t                 value;
+};
+
+struct __attribute__((__packed__)) em_dev_info {
+  uint16_t                vendor;
+  uint16_t                product;
+  uint16_t                version;
+  char                    name[32];
+};
+
+struct __attribute__((__packed__)) em_dev_bits {
+  uint8_t                 type;
+  uint8_t                 chunk;
+  uint32_t                bits[8];
+};
+
+struct __attribute__((__packed__)) em_dev_abs {
+  uint16_t                code;
+   int32_t                minimum;
+   int32_t                maximum;
+   int32_t                fuzz;
+   int32_t                flat;
+   int32_t                resolution;
+};
+
+struct __attribute__((__packed__)) em_dev_props {
+  uint32_t                bits;
+};
+
+struct __attribute__((__packed__)) em_dev_commit {
+  uint16_t                num;
+  uint32_t                caps;
+};
+
+struct __attribute__((__packed__)) em_mt_entry {
+  uint8_t                 slot_axis;  // Slot << 4 | code - ABS_MT_TOUCH_MAJOR
+   int32_t                value;
+};
+
+// Must match em_shm_slot/em_shm_ring of the server
+typedef struct {
+  uint64_t                seq;        // 0 while written, index + 1 when done
+  uint16_t                len;
+  uint8_t                 buf[MAX_DATAGRAM_SIZE];
+} shm_slot;
+
+typedef struct {
+  uint32_t                magic;
+  uint32_t                slots;
+  uint64_t                head;
+  shm_slot                slot[SHM_SLOTS];
+} shm_ring;
+
+// Virtual copies of server devices with absolute axes (gamepads, sticks),
+// indexed by the server's device index. Their events arrive with the slot
+// in the high byte of the type.
+typedef struct {
+  struct libevdev        *pending;    // Descriptor being received
+  int                     pending_num;
+  struct libevdev_uinput *uidev;
+  uint32_t                caps;
+} mirror_dev;
+
+typedef struct {
+  int           synced;
+  uint16_t      last;       // Last key sequence applied
+  unsigned long recovered;
+  unsigned long dups;
+} keylog_state;
+
+// Jitter buffer for motion. REL events are collected per SYN_REPORT frame
+// and played out at the server's cadence, delayed by a target sized from
+// the observed jitter. Anything else flushes the buffer and goes out
+// immediately, so clicks still land where the pointer was sent to.
+typedef struct {
+  uint64_t due;
+  int      num;
+  uint16_t code[JITTER_EVENTS];
+  int32_t  value[JITTER_EVENTS];
+} jitter_frame;
+
+typedef struct {
+  int          max_ms;      // 0 disables the buffer
+
+  jitter_frame frames[JITTER_FRAMES];
+  int          head;
+  int          count;
+  jitter_frame cur;         // Frame being received
+  int          direct;      // Rest of the current frame bypasses the buffer
+
+  int          have_clock;
+  uint64_t     sender_ms;   // Last server stamp, unwrapped
+  int64_t      base;        // Smallest transit seen, server clock to ours
+  uint64_t     base_aged;
+  int          jitter_x16;  // Average transit above base, in ms * 16
+} jitter_state;
+
+// One client ID served by this process. Each has its own output device,
+// key and stream state, see -c.
+#define MAX_SEATS 32
+
+typedef struct {
+  int                     client_id;
+  char                   *key;        // NULL for no encryption
+  char                   *name;       // Added to device names, may be NULL
+  struct libevdev_uinput *uiodev;
+  keylog_state            keylog;
+  jitter_state            jb;
+  mirror_dev              mirrors[MAX_SLOTS];
+} seat;
+
+static seat  seats[MAX_SEATS];
+static int   num_seats = 0;
+static seat *seat_by_idx[256];
+
+// Groups joined with -G. Their packets are decrypted once with the group
+// key and go to every seat.
+typedef struct {
+  int                     group_id;
+  char                   *key;        // NULL for no encryption
+} group;
+
+static group  groups[MAX_GROUPS];
+static int    num_groups = 0;
+static group *group_by_idx[256];
+
 static void show_usage(const char *arg0)
 {
   fprintf(stderr, "\n");
-  fprintf(stderr, "Usage: %s [-c <clientID>] [-k <encKey>] [-p <port>] [-i <iface>] [-g <group>]\n", arg0);
+  fprintf(stderr, "Usage: %s [-c <clientID>[:<encKey>[:<name>]]]... [-G <groupID>[:<encKey>]]... [-k <encKey>] [-p <port>] [-i <iface>] [-g <group>] [-a <ms>] [-j <ms>]\n", arg0);
+  fprintf(stderr, "       %s [-c <clientID>[:<encKey>[:<name>]]]... [-G <groupID>[:<encKey>]]... -s <path> [-j <ms>]\n", arg0);
   fprintf(stderr, "\n");
   fprintf(stderr, "         All command line options are optional. Default is to use clientID 1,\n");
-  fprintf(stderr, "         no encryption, group address 239.255.77.77 and port 4020.\n");
+  fprintf(stderr, "         no encryption, group address 239.255.77.88 and port 4020.\n");
   fprintf(stderr, "\n");
-  fprintf(stderr, "         -c <clientId>: Set client ID.\n");
-  fprintf(stderr, "         -k <encKey>  : Enable encryption by setting encryption key.\n");
+  fprintf(stderr, "         -c <clientId>: Set client ID. Repeat to serve several client IDs,\n");
+  fprintf(stderr, "                        each with its own output device. An ID can be\n");
+  fprintf(stderr, "                        followed by its own key and a seat name for the\n");
+  fprintf(stderr, "                        device names, separated by colons.\n");
+  fprintf(stderr, "         -G <groupId> : Also take events sent to this group, numbered from 0\n");
+  fprintf(stderr, "                        in the server's \"groups\" section, on all client\n");
+  fprintf(stderr, "                        IDs. Can be followed by the group key.\n");
+  fprintf(stderr, "         -k <encKey>  : Enable encryption by setting encryption key, for\n");
+  fprintf(stderr, "                        client and group IDs without a key of their own.\n");
   fprintf(stderr, "         -i <iface>   : Use local interface <iface>. Either the IP\n");
-  fprintf(stderr, "                        or the interface name can be specified.\n");
-  // fprintf(stderr, "         -p <port>    : Use <port> instead of default port 4020.\n");
-  // fprintf(stderr, "         -g <group>   : Multicast group address.\n");
+  fprintf(stderr, "                        or the interface name can be specified,\n");
+  fprintf(stderr, "                        IPv6 groups need the name.\n");
+  fprintf(stderr, "         -a <ms>      : Announce presence to the server every <ms>\n");
+  fprintf(stderr, "                        milliseconds, default 1000. 0 disables.\n");
+  fprintf(stderr, "         -j <ms>      : Smooth out mouse motion with a jitter buffer\n");
+  fprintf(stderr, "                        delaying motion by at most <ms> milliseconds.\n");
+  fprintf(stderr, "         -p <port>    : Use <port> instead of default port 4020.\n");
+  fprintf(stderr, "                        Presence goes to <port> + 1.\n");
+  fprintf(stderr, "         -g <group>   : Multicast group address, IPv4 or IPv6\n");
+  fprintf(stderr, "                        (ff02::/ff05::...).\n");
+  fprintf(stderr, "         -s <path>    : Receive from a server on this host through shared\n");
+  fprintf(stderr, "                        memory, <path> is the client's \"shm\" socket in\n");
+  fprintf(stderr, "                        the server config. No multicast, no presence.\n");
   fprintf(stderr, "\n");
   exit(1);
 }
@@ -86,26 +284,649 @@ error_exit:
   exit(1);
 }
 
+static uint64_t now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void announce(int sockfd, struct sockaddr *addr, socklen_t addrlen, int client_id, const char *encryption_key)
+{
+  struct em_packet packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.clientIdx = client_id;
+  packet.type = PRESENCE_TYPE;
+  size_t len = MIN_PACKET_SIZE;
+
+  if (encryption_key) {
+    packet.rnd = random();
+    size_t enclen;
+    unsigned char *encdata = xxtea_encrypt(&(packet.rnd), MIN_PACKET_SIZE - 2, encryption_key, &enclen);
+    if (!encdata) return;
+    if (enclen == MAX_PACKET_SIZE - 2) {
+      memcpy(&(packet.rnd), encdata, enclen);
+      packet.enc = enclen;
+      len = MAX_PACKET_SIZE;
+    }
+    free(encdata);
+    if (!packet.enc) return;
+  }
+
+  sendto(sockfd, &packet, len, 0, addr, addrlen);
+}
+
+static void write_event(seat *s, uint16_t type, uint16_t code, int32_t value)
+{
+  int rc = libevdev_uinput_write_event(s->uiodev, type, code, value);
+  if (rc != 0) {
+    printf("Sending event failed with rc %d on uinput device.\n", rc);
+    exit(-1);
+  }
+}
+
+static void jitter_play_frame(seat *s, jitter_frame *frame)
+{
+  for (int e = 0; e < frame->num; e++)
+    write_event(s, EV_REL, frame->code[e], frame->value[e]);
+  write_event(s, EV_SYN, SYN_REPORT, 0);
+  frame->num = 0;
+}
+
+static void jitter_flush(seat *s)
+{
+  while (s->jb.count) {
+    jitter_play_frame(s, &s->jb.frames[s->jb.head]);
+    s->jb.head = (s->jb.head + 1) % JITTER_FRAMES;
+    s->jb.count--;
+  }
+}
+
+// Play frames that are due. Returns ms until the next one, or -1.
+static int jitter_play(seat *s, uint64_t now)
+{
+  while (s->jb.count) {
+    jitter_frame *frame = &s->jb.frames[s->jb.head];
+    if (frame->due > now) return (int)(frame->due - now);
+    jitter_play_frame(s, frame);
+    s->jb.head = (s->jb.head + 1) % JITTER_FRAMES;
+    s->jb.count--;
+  }
+  return -1;
+}
+
+static uint64_t jitter_due(seat *s, uint32_t rnd, uint64_t now)
+{
+  uint16_t stamp = rnd & STAMP_MASK;
+  if (!s->jb.have_clock) s->jb.sender_ms = stamp;
+  else s->jb.sender_ms += (int16_t)(stamp - (uint16_t)s->jb.sender_ms);
+
+  int64_t transit = (int64_t)now - (int64_t)s->jb.sender_ms;
+  if (!s->jb.have_clock || transit < s->jb.base) {
+    s->jb.base = transit;
+    s->jb.base_aged = now;
+  }
+  else if (now - s->jb.base_aged >= 1000) {
+    // Let the base creep up so we follow clock drift.
+    s->jb.base++;
+    s->jb.base_aged = now;
+  }
+  s->jb.have_clock = 1;
+
+  int above = (int)(transit - s->jb.base);
+  s->jb.jitter_x16 += above - s->jb.jitter_x16 / 16;
+
+  int delay = s->jb.jitter_x16 / 8 + 1;
+  if (delay > s->jb.max_ms) delay = s->jb.max_ms;
+
+  uint64_t due = s->jb.sender_ms + s->jb.base + delay;
+  if (due > now + s->jb.max_ms) due = now + s->jb.max_ms;
+  return due;
+}
+
+static void jitter_event(seat *s, struct em_packet *packet, uint64_t now)
+{
+  if (!s->jb.max_ms) {
+    write_event(s, packet->type, packet->code, packet->value);
+    return;
+  }
+
+  if (packet->type == EV_REL && !s->jb.direct) {
+    jitter_frame *cur = &s->jb.cur;
+    for (int e = 0; e < cur->num; e++) {
+      if (cur->code[e] == packet->code) {
+        cur->value[e] += packet->value;
+        return;
+      }
+    }
+    if (cur->num < JITTER_EVENTS) {
+      cur->code[cur->num] = packet->code;
+      cur->value[cur->num] = packet->value;
+      cur->num++;
+      return;
+    }
+  }
+
+  if (packet->type == EV_SYN && packet->code == SYN_REPORT && !s->jb.direct) {
+    // Empty frames have nothing to report.
+    if (!s->jb.cur.num) return;
+
+    // Buffer full, make room.
+    if (s->jb.count == JITTER_FRAMES) {
+      jitter_play_frame(s, &s->jb.frames[s->jb.head]);
+      s->jb.head = (s->jb.head + 1) % JITTER_FRAMES;
+      s->jb.count--;
+    }
+    jitter_frame *frame = &s->jb.frames[(s->jb.head + s->jb.count) % JITTER_FRAMES];
+    *frame = s->jb.cur;
+    frame->due = jitter_due(s, packet->rnd, now);
+    s->jb.count++;
+    s->jb.cur.num = 0;
+    jitter_play(s, now);
+    return;
+  }
+
+  // Keys, buttons and everything else: motion sent before goes out first.
+  jitter_flush(s);
+  for (int e = 0; e < s->jb.cur.num; e++)
+    write_event(s, EV_REL, s->jb.cur.code[e], s->jb.cur.value[e]);
+  s->jb.cur.num = 0;
+  write_event(s, packet->type, packet->code, packet->value);
+  s->jb.direct = !(packet->type == EV_SYN && packet->code == SYN_REPORT);
+}
+
+static int seq_after(uint16_t a, uint16_t b)
+{
+  return (int16_t)(a - b) > 0;
+}
+
+// Servers with "redundancy" set repeat the last key transitions in every
+// packet. Apply the ones we never saw, in order. Returns 0 if the event
+// carrying the log is a key transition we already applied.
+static int keylog_receive(seat *s, struct em_ext_header *ext, uint32_t rnd, uint64_t now)
+{
+  struct em_keylog_entry *entries = (struct em_keylog_entry *)(ext + 1);
+  int num = (ext->len - sizeof(*ext)) / sizeof(*entries);
+  uint16_t newest = ext->seq ? ext->seq : (num ? entries[num - 1].seq : 0);
+  if (!newest) return 1;
+
+  // Start following on the first packet, and again when the sequence
+  // jumps back further than any duplicate could (server restarted).
+  if (!s->keylog.synced || (!seq_after(newest, s->keylog.last) && (uint16_t)(s->keylog.last - newest) >= KEYLOG_WINDOW)) {
+    s->keylog.synced = 1;
+    s->keylog.last = newest;
+    return 1;
+  }
+
+  for (int e = 0; e < num; e++) {
+    if (!seq_after(entries[e].seq, s->keylog.last)) continue;
+    struct em_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.rnd   = rnd;
+    packet.type  = EV_KEY;
+    packet.code  = entries[e].code;
+    packet.value = entries[e].value;
+    jitter_event(s, &packet, now);
+    packet.type  = EV_SYN;
+    packet.code  = SYN_REPORT;
+    packet.value = 0;
+    jitter_event(s, &packet, now);
+    s->keylog.last = entries[e].seq;
+    s->keylog.recovered++;
+    printf("Client idx #%u: Recovered lost key event (%lu so far)\n", s->client_id, s->keylog.recovered);
+  }
+
+  if (ext->seq) {
+    if (!seq_after(ext->seq, s->keylog.last)) {
+      s->keylog.dups++;
+      return 0;
+    }
+    s->keylog.last = ext->seq;
+  }
+  return 1;
+}
+
+// Build a device from descriptor messages, create it once complete.
+static void device_message(seat *s, int slot, int what, void *data, size_t size)
+{
+  if (slot < 0 || slot >= MAX_SLOTS) return;
+  mirror_dev *mirror = &s->mirrors[slot];
+
+  if (what == DEV_INFO) {
+    struct em_dev_info *info = data;
+    if (size < sizeof(*info)) return;
+    if (mirror->pending) libevdev_free(mirror->pending);
+    mirror->pending = libevdev_new();
+    mirror->pending_num = 1;
+
+    char name[sizeof(info->name) + 1];
+    memcpy(name, info->name, sizeof(info->name));
+    name[sizeof(info->name)] = '\0';
+    char fullname[sizeof(name) + 80];
+    if (s->name) snprintf(fullname, sizeof(fullname), "Octopus %s (%s)", name, s->name);
+    else snprintf(fullname, sizeof(fullname), "Octopus %s", name);
+    libevdev_set_name(mirror->pending, fullname);
+    libevdev_set_id_vendor(mirror->pending, info->vendor);
+    libevdev_set_id_product(mirror->pending, info->product);
+    libevdev_set_id_version(mirror->pending, info->version);
+    libevdev_enable_event_type(mirror->pending, EV_SYN);
+    return;
+  }
+  if (!mirror->pending) return;
+
+  switch (what) {
+  case DEV_BITS: {
+    struct em_dev_bits *bits = data;
+    if (size < sizeof(*bits)) return;
+    libevdev_enable_event_type(mirror->pending, bits->type);
+    for (int c = 0; c < 256; c++) {
+      if (bits->bits[c / 32] & (1u << (c % 32)))
+        libevdev_enable_event_code(mirror->pending, bits->type, bits->chunk * 256 + c, NULL);
+    }
+    break;
+  }
+  case DEV_ABS: {
+    struct em_dev_abs *abs = data;
+    if (size < sizeof(*abs)) return;
+    struct input_absinfo absinfo;
+    memset(&absinfo, 0, sizeof(absinfo));
+    absinfo.minimum    = abs->minimum;
+    absinfo.maximum    = abs->maximum;
+    absinfo.fuzz       = abs->fuzz;
+    absinfo.flat       = abs->flat;
+    absinfo.resolution = abs->resolution;
+    libevdev_enable_event_code(mirror->pending, EV_ABS, abs->code, &absinfo);
+    break;
+  }
+  case DEV_PROPS: {
+    struct em_dev_props *props = data;
+    if (size < sizeof(*props)) return;
+    for (int p = 0; p < 32; p++) {
+      if (props->bits & (1u << p)) libevdev_enable_property(mirror->pending, p);
+    }
+    break;
+  }
+  case DEV_COMMIT: {
+    struct em_dev_commit *commit = data;
+    if (size < sizeof(*commit)) return;
+    mirror->pending_num++;
+
+    // Parts got lost, or nothing changed: wait for the next one.
+    if (commit->num == mirror->pending_num && !(mirror->uidev && mirror->caps == commit->caps)) {
+      if (mirror->uidev) libevdev_uinput_destroy(mirror->uidev);
+      mirror->uidev = NULL;
+      if (libevdev_uinput_create_from_device(mirror->pending, LIBEVDEV_UINPUT_OPEN_MANAGED, &mirror->uidev) == 0) {
+        mirror->caps = commit->caps;
+        printf("Client idx #%u: Created %s for server device #%d\n", s->client_id, libevdev_get_name(mirror->pending), slot);
+      }
+      else {
+        mirror->uidev = NULL;
+        printf("Client idx #%u: Unable to create device for server device #%d\n", s->client_id, slot);
+      }
+    }
+    libevdev_free(mirror->pending);
+    mirror->pending = NULL;
+    return;
+  }
+  default:
+    return;
+  }
+  mirror->pending_num++;
+}
+
+// Apply changed touch slot fields to a mirrored touchpad. The frame is
+// completed by the SYN_REPORT the server sends after them.
+static void mt_frame(seat *s, int slot, struct em_mt_entry *entries, int num)
+{
+  if (slot < 0 || slot >= MAX_SLOTS || !s->mirrors[slot].uidev) return;
+  struct libevdev_uinput *uidev = s->mirrors[slot].uidev;
+
+  int current = -1;
+  for (int e = 0; e < num; e++) {
+    int touch = entries[e].slot_axis >> 4;
+    if (touch != current) {
+      libevdev_uinput_write_event(uidev, EV_ABS, ABS_MT_SLOT, touch);
+      current = touch;
+    }
+    libevdev_uinput_write_event(uidev, EV_ABS, ABS_MT_TOUCH_MAJOR + (entries[e].slot_axis & 0xf), entries[e].value);
+  }
+}
+
+// Apply a decoded packet holding 'len' bytes of event and extensions to
+// a seat. Group packets carry no key log, the seat's one doesn't apply.
+static void apply_packet(seat *s, uint8_t *buf, size_t len, int grouped)
+{
+  struct em_packet *packet = (struct em_packet *)buf;
+  uint64_t now = now_ms();
+  int dup = 0;
+  size_t offset = MIN_PACKET_SIZE;
+  while (offset + sizeof(struct em_ext_header) <= len + 2) {
+    struct em_ext_header *ext = (struct em_ext_header *)&buf[offset];
+    if (ext->len < sizeof(*ext) || offset + ext->len > len + 2) break;
+
+    if (ext->type == EXT_KEYLOG && !grouped && !keylog_receive(s, ext, packet->rnd, now)) dup = 1;
+    if (ext->type == EXT_DEVICE && packet->type == TYPE_DEVICE)
+      device_message(s, packet->code, packet->value, ext + 1, ext->len - sizeof(*ext));
+    if (ext->type == EXT_MTFRAME && packet->type == TYPE_MTFRAME)
+      mt_frame(s, packet->code, (struct em_mt_entry *)(ext + 1), (ext->len - sizeof(*ext)) / sizeof(struct em_mt_entry));
+    offset += ext->len;
+  }
+  if (dup || packet->type == TYPE_DEVICE || packet->type == TYPE_MTFRAME) return;
+
+  // Events for mirrored devices skip the jitter buffer.
+  if (packet->type >> 8) {
+    int slot = (packet->type >> 8) - 1;
+    if (slot < MAX_SLOTS && s->mirrors[slot].uidev)
+      libevdev_uinput_write_event(s->mirrors[slot].uidev, packet->type & 0xff, packet->code, packet->value);
+    return;
+  }
+
+  jitter_event(s, packet, now);
+}
+
+// Decode and apply one packet of 'n' bytes, from the socket or the ring.
+static void handle_packet(uint8_t *buf, ssize_t n)
+{
+  struct em_packet *packet = (struct em_packet *)buf;
+  if (n < MIN_PACKET_SIZE) return;
+  // One stream for all our client and group IDs, packets for others are
+  // dropped here.
+  seat *s = seat_by_idx[packet->clientIdx];
+  group *g = group_by_idx[packet->clientIdx];
+  if (!s && !g) return;
+  char *key = s ? s->key : g->key;
+
+  // Length of the event plus extensions
+  size_t len = n - 2;
+  if (packet->enc) {
+    if (!key || packet->enc > n - 2) return;
+    unsigned char *decrypt_data = xxtea_decrypt(&(packet->rnd), packet->enc, key, &len);
+    if (!decrypt_data) return;
+    if (len < MIN_PACKET_SIZE - 2 || len > MAX_DATAGRAM_SIZE - 2) {
+      free(decrypt_data);
+      return;
+    }
+    memcpy(&(packet->rnd), decrypt_data, len);
+    free(decrypt_data);
+  }
+
+  if (s) apply_packet(s, buf, len, 0);
+  else
+    for (int i = 0; i < num_seats; i++) apply_packet(&seats[i], buf, len, 1);
+}
+
+// Get the ring and our doorbell eventfd from the server listening at
+// 'path'. Returns the eventfd. The connection stays open, the server
+// stops ringing once it's closed.
+static int shm_attach(const char *path, shm_ring **ring)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Path too long: %s\n", path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Unable to connect to %s\n", path);
+    exit(1);
+  }
+
+  uint32_t info[2];
+  struct iovec iov = { .iov_base = info, .iov_len = sizeof(info) };
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = n == sizeof(info) ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))
+      || info[0] != SHM_MAGIC || info[1] != sizeof(shm_ring)) {
+    fprintf(stderr, "Unexpected answer from %s, client and server versions differ?\n", path);
+    exit(1);
+  }
+  int fds[2];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  *ring = mmap(NULL, sizeof(shm_ring), PROT_READ, MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if (*ring == MAP_FAILED) {
+    fprintf(stderr, "Unable to map shared memory from %s\n", path);
+    exit(1);
+  }
+  return fds[1];
+}
+
+// Apply what the server published since *tail. Slots are checked like a
+// seqlock, a slot rewritten while copying it counts as lost.
+static void shm_receive(shm_ring *ring, uint64_t *tail)
+{
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t lost = 0;
+  if (head - *tail > SHM_SLOTS) {
+    lost = head - *tail - SHM_SLOTS;
+    *tail = head - SHM_SLOTS;
+  }
+
+  for (; *tail != head; (*tail)++) {
+    shm_slot *slot = &ring->slot[*tail & (SHM_SLOTS - 1)];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    uint8_t buf[MAX_DATAGRAM_SIZE];
+    size_t len = slot->len;
+    if (len > sizeof(buf)) len = sizeof(buf);
+    memcpy(buf, slot->buf, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (seq != *tail + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+      lost++;
+      continue;
+    }
+    handle_packet(buf, len);
+  }
+  if (lost) printf("Shared memory: fell behind, %llu packets lost\n", (unsigned long long)lost);
+}
+
+// Parse -c <clientID>[:<encKey>[:<name>]]
+static void add_seat(const char *arg0, char *spec)
+{
+  char *key = strchr(spec, ':');
+  char *name = NULL;
+  if (key) {
+    *key++ = '\0';
+    name = strchr(key, ':');
+    if (name) *name++ = '\0';
+    if (!*key) key = NULL;
+    if (name && !*name) name = NULL;
+  }
+
+  char *end;
+  long id = strtol(spec, &end, 10);
+  if (!*spec || *end || id < 0 || id >= GROUP_BASE) {
+    fprintf(stderr, "Invalid client ID: %s\n", spec);
+    show_usage(arg0);
+  }
+  if (seat_by_idx[id]) {
+    fprintf(stderr, "Client ID %ld given twice\n", id);
+    show_usage(arg0);
+  }
+  if (num_seats == MAX_SEATS) {
+    fprintf(stderr, "At most %d client IDs per process\n", MAX_SEATS);
+    show_usage(arg0);
+  }
+
+  seat *s = &seats[num_seats++];
+  s->client_id = id;
+  s->key = key;
+  s->name = name;
+  seat_by_idx[id] = s;
+}
+
+// Parse -G <groupID>[:<encKey>]
+static void add_group(const char *arg0, char *spec)
+{
+  char *key = strchr(spec, ':');
+  if (key) {
+    *key++ = '\0';
+    if (!*key) key = NULL;
+  }
+
+  char *end;
+  long id = strtol(spec, &end, 10);
+  if (!*spec || *end || id < 0 || id >= MAX_GROUPS) {
+    fprintf(stderr, "Invalid group ID: %s\n", spec);
+    show_usage(arg0);
+  }
+  if (group_by_idx[GROUP_BASE + id]) {
+    fprintf(stderr, "Group ID %ld given twice\n", id);
+    show_usage(arg0);
+  }
+
+  group *g = &groups[num_groups++];
+  g->group_id = id;
+  g->key = key;
+  group_by_idx[GROUP_BASE + id] = g;
+}
+
+static void create_output(seat *s)
+{
+  char name[128];
+  if (s->name) snprintf(name, sizeof(name), "Octopus Output (%s)", s->name);
+  else if (num_seats > 1) snprintf(name, sizeof(name), "Octopus Output (client %d)", s->client_id);
+  else snprintf(name, sizeof(name), "Octopus Output");
+
+  struct libevdev *odev = libevdev_new();
+  libevdev_set_name(odev, name);
+
+  libevdev_enable_event_type(odev, EV_SYN);
+  for (int k = 0; k < SYN_CNT; k++)
+    if (libevdev_event_code_get_name(EV_SYN, k)) libevdev_enable_event_code(odev, EV_SYN, k, NULL);
+
+  libevdev_enable_event_type(odev, EV_KEY);
+  for (int k = 0; k < KEY_CNT; k++)
+    if (libevdev_event_code_get_name(EV_KEY, k)) libevdev_enable_event_code(odev, EV_KEY, k, NULL);
+
+  libevdev_enable_event_type(odev, EV_REL);
+  for (int k = 0; k < REL_CNT; k++)
+    if (libevdev_event_code_get_name(EV_REL, k)) libevdev_enable_event_code(odev, EV_REL, k, NULL);
+
+  if (libevdev_uinput_create_from_device(odev, LIBEVDEV_UINPUT_OPEN_MANAGED, &s->uiodev) != 0) {
+    printf("Unable to open output device.\n");
+    exit(-1);
+  }
+  libevdev_free(odev);
+}
+
+// Join the group, presence announcements go to *presaddr.
+static int open_multicast(const char *multicast_group, const char *iface_name, uint16_t port,
+                          struct sockaddr_storage *presaddr, socklen_t *presaddr_len)
+{
+  int sockfd;
+  memset((void *)presaddr, 0, sizeof(*presaddr));
+
+  struct in6_addr group6;
+  if (inet_pton(AF_INET6, multicast_group, &group6) == 1) {
+    unsigned int ifindex = 0;
+    if (iface_name) {
+      ifindex = if_nametoindex(iface_name);
+      if (!ifindex) {
+        fprintf(stderr, "Invalid interface: %s\n\n", iface_name);
+        exit(1);
+      }
+    }
+    sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+
+    struct sockaddr_in6 servaddr;
+    memset((void *)&servaddr, 0, sizeof(servaddr));
+    servaddr.sin6_family = AF_INET6;
+    servaddr.sin6_addr = in6addr_any;
+    servaddr.sin6_port = htons(port);
+    bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+
+    struct ipv6_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.ipv6mr_multiaddr = group6;
+    mreq.ipv6mr_interface = ifindex;
+    if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0) {
+      fprintf(stderr, "Unable to join group %s\n", multicast_group);
+      exit(1);
+    }
+
+    struct sockaddr_in6 *pres6 = (struct sockaddr_in6 *)presaddr;
+    pres6->sin6_family = AF_INET6;
+    pres6->sin6_addr = group6;
+    pres6->sin6_port = htons(port + 1);
+    pres6->sin6_scope_id = ifindex;
+    *presaddr_len = sizeof(*pres6);
+    if (ifindex) setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+  }
+  else {
+    in_addr_t interface = iface_name ? get_interface(iface_name) : INADDR_ANY;
+    sockfd = socket(AF_INET,SOCK_DGRAM,0);
+
+    struct sockaddr_in servaddr;
+    memset((void *)&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+    bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+
+    struct ip_mreq imreq;
+    memset(&imreq, 0, sizeof(imreq));
+    imreq.imr_multiaddr.s_addr = inet_addr(multicast_group);
+    imreq.imr_interface.s_addr = interface;
+
+    setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+              (const void *)&imreq, sizeof(struct ip_mreq));
+
+    struct sockaddr_in *pres4 = (struct sockaddr_in *)presaddr;
+    pres4->sin_family = AF_INET;
+    pres4->sin_addr.s_addr = imreq.imr_multiaddr.s_addr;
+    pres4->sin_port = htons(port + 1);
+    *presaddr_len = sizeof(*pres4);
+    if (interface != INADDR_ANY) {
+      struct in_addr ifaddr = { .s_addr = interface };
+      setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+    }
+  }
+
+  printf("Listening for events at %s port %u\n", multicast_group, port);
+  return sockfd;
+}
+
 int main(int argc, char*argv[]) {
   // Command line options
-  int         client_id = 1;
-  char *multicast_group = NULL;
+  char *multicast_group = DEFAULT_MULTICAST_GROUP;
   char  *encryption_key = NULL;
-  in_addr_t   interface = INADDR_ANY;
+  char     *iface_name = NULL;
   uint16_t         port = DEFAULT_PORT;
+  int       announce_ms = DEFAULT_ANNOUNCE_MS;
+  int            max_ms = 0;
+  char        *shm_path = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "i:g:p:c:k:")) != -1) {
+  while ((opt = getopt(argc, argv, "i:g:p:c:G:k:a:j:s:")) != -1) {
     switch (opt) {
     case 'i':
-      interface = get_interface(optarg);
+      iface_name = strdup(optarg);
       break;
     case 'p':
       port = atoi(optarg);
       if (!port) show_usage(argv[0]);
       break;
     case 'c':
-      client_id = atoi(optarg);
+      add_seat(argv[0], strdup(optarg));
+      break;
+    case 'G':
+      add_group(argv[0], strdup(optarg));
       break;
     case 'g':
       multicast_group = strdup(optarg);
@@ -113,6 +934,17 @@ int main(int argc, char*argv[]) {
     case 'k':
       encryption_key = strdup(optarg);
       break;
+    case 'a':
+      announce_ms = atoi(optarg);
+      if (announce_ms < 0) show_usage(argv[0]);
+      break;
+    case 'j':
+      max_ms = atoi(optarg);
+      if (max_ms < 0) show_usage(argv[0]);
+      break;
+    case 's':
+      shm_path = strdup(optarg);
+      break;
     default:
       show_usage(argv[0]);
     }
@@ -122,68 +954,69 @@ int main(int argc, char*argv[]) {
     show_usage(argv[0]);
   }
 
-  printf("Client idx #%u, encryption %s\n", client_id, encryption_key ? "enabled" : "disabled");
-
-  struct libevdev_uinput *uiodev;
-  struct libevdev *odev = libevdev_new();
-  libevdev_set_name(odev, "Octopus Output");
-
-  libevdev_enable_event_type(odev, EV_SYN);
-  for (int k = 0; k < SYN_CNT; k++)
-    if (libevdev_event_code_get_name(EV_SYN, k)) libevdev_enable_event_code(odev, EV_SYN, k, NULL);
-
-  libevdev_enable_event_type(odev, EV_KEY);
-  for (int k = 0; k < KEY_CNT; k++)
-    if (libevdev_event_code_get_name(EV_KEY, k)) libevdev_enable_event_code(odev, EV_KEY, k, NULL);
-
-  libevdev_enable_event_type(odev, EV_REL);
-  for (int k = 0; k < REL_CNT; k++)
-    if (libevdev_event_code_get_name(EV_REL, k)) libevdev_enable_event_code(odev, EV_REL, k, NULL);
+  if (!num_seats) add_seat(argv[0], strdup("1"));
 
-  if (libevdev_uinput_create_from_device(odev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uiodev) != 0) {
-    printf("Unable to open output device.\n");
-    exit(-1);
+  for (int i = 0; i < num_seats; i++) {
+    seat *s = &seats[i];
+    if (!s->key) s->key = encryption_key;
+    s->jb.max_ms = max_ms;
+    printf("Client idx #%u%s%s, encryption %s\n", s->client_id,
+      s->name ? " seat " : "", s->name ? s->name : "", s->key ? "enabled" : "disabled");
+    create_output(s);
   }
+  for (int i = 0; i < num_groups; i++) {
+    group *g = &groups[i];
+    if (!g->key) g->key = encryption_key;
+    printf("Group #%u, encryption %s\n", g->group_id, g->key ? "enabled" : "disabled");
+  }
+  if (max_ms) printf("Jitter buffer enabled, at most %dms\n", max_ms);
 
-  int sockfd = socket(AF_INET,SOCK_DGRAM,0);
-
-  struct sockaddr_in servaddr;
-  memset((void *)&servaddr, 0, sizeof(servaddr));
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  servaddr.sin_port = htons(port);
-  bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr));
-
-  struct ip_mreq imreq;
-  memset(&imreq, 0, sizeof(imreq));
-  imreq.imr_multiaddr.s_addr = inet_addr(multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP);
-  imreq.imr_interface.s_addr = interface;
-
-  setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-            (const void *)&imreq, sizeof(struct ip_mreq));
+  int sockfd = -1, bellfd = -1;
+  struct sockaddr_storage presaddr;
+  socklen_t presaddr_len = 0;
+  shm_ring *ring = NULL;
+  uint64_t ring_tail = 0;
+  if (shm_path) {
+    bellfd = shm_attach(shm_path, &ring);
+    ring_tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    announce_ms = 0;
+    printf("Receiving events through shared memory at %s\n", shm_path);
+  }
+  else sockfd = open_multicast(multicast_group, iface_name, port, &presaddr, &presaddr_len);
 
-  printf("Listening for events at %s:%u\n",
-    multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP,
-    port);
+  srandom(time(NULL) ^ getpid());
+  uint64_t next_announce = 0;
 
   for (;;) {
-    struct em_packet packet;
-    size_t n = recvfrom(sockfd, &packet, MAX_PACKET_SIZE, 0, NULL, 0);
-    if (n < MIN_PACKET_SIZE) continue;
-    if (packet.clientIdx != client_id) continue;
-
-    if (packet.enc) {
-      unsigned char *decrypt_data = xxtea_decrypt(&(packet.rnd), packet.enc, encryption_key, &n);
-      if (!decrypt_data || n > MAX_PACKET_SIZE - 2) continue;
-      memcpy(&(packet.rnd), decrypt_data, n);
-      free(decrypt_data);
+    uint64_t now = now_ms();
+    int timeout = -1;
+    if (announce_ms) {
+      if (now >= next_announce) {
+        for (int i = 0; i < num_seats; i++)
+          announce(sockfd, (struct sockaddr *)&presaddr, presaddr_len, seats[i].client_id, seats[i].key);
+        next_announce = now + announce_ms;
+      }
+      timeout = (int)(next_announce - now);
     }
+    for (int i = 0; i < num_seats; i++) {
+      int jitter_ms = jitter_play(&seats[i], now);
+      if (jitter_ms >= 0 && (timeout < 0 || jitter_ms < timeout)) timeout = jitter_ms;
+    }
+
+    struct pollfd pfd = { .fd = ring ? bellfd : sockfd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout) <= 0) continue;
 
-    int rc = libevdev_uinput_write_event(uiodev, packet.type, packet.code, packet.value);
-    if (rc != 0) {
-      printf("Sending event failed with rc %d on uinput device.\n", rc);
-      exit(-1);
+    if (ring) {
+      // Nothing to read is fine too, the ring is what counts.
+      uint64_t rings;
+      if (read(bellfd, &rings, sizeof(rings)) < 0 && errno != EAGAIN) continue;
+      shm_receive(ring, &ring_tail);
+      continue;
     }
+
+    uint8_t buf[MAX_DATAGRAM_SIZE];
+    ssize_t n = recvfrom(sockfd, buf, MAX_DATAGRAM_SIZE, 0, NULL, 0);
+    handle_packet(buf, n);
   }
 
   BAIL:
@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <xxtea.h>
+#include <linux/input.h>
+
+// Synthetic load for octopus clients. Send mode emits em_packet streams
+// like the server does, for many client indices at once. Sink mode
+// receives them like octopus-client, but only counts, verifies and times
+// the decoded events instead of writing them to /dev/uinput.
+//
+// Generated packets carry the send time in 'rnd': the low 16 bits are the
+// ms clock like the server's stamp, so real clients pace them correctly,
+// the high 16 bits the microseconds within that ms. The closing
+// SYN_REPORT of every frame has a per-client frame counter as its value,
+// which real clients pass on harmlessly. Latencies are only meaningful
+// when sender and sink share a clock, i.e. over loopback.
+//
+// The sender lets go of all keys before it exits, so a sink that saw
+// every packet in order ends with no key held down. The sink applies key
+// events in arrival order like a client would and reports what is left.
+
+#define DEFAULT_MULTICAST_GROUP "239.255.77.88"
+#define DEFAULT_PORT 4020
+
+#define MIN_PACKET_SIZE 14
+#define MAX_PACKET_SIZE 18
+#define MAX_CLIENTS 256
+
+// Low 16 bits of rnd carry the ms clock, the stamp wraps after this long
+#define STAMP_MASK 0xffff
+#define STAMP_PERIOD_US ((uint64_t)(STAMP_MASK + 1) * 1000)
+
+struct __attribute__((__packed__)) em_packet {
+  // Sent unencrypted
+  uint8_t                 clientIdx;  // 1
+  uint8_t                 enc;        // 1
+  // Encrypted parts, sending 12 bytes in the clear, 16 when encrypted.
+  uint32_t                rnd;        // 4
+  uint16_t                type;       // 2
+  uint16_t                code;       // 2
+   int32_t                value;      // 4
+  // Extra bytes for encryption
+  uint32_t                _space_;    // 4
+};
+
+typedef struct {
+  // Send mode
+  uint64_t next_due;
+  uint32_t frame;
+  int      key_down;
+
+  // Sink mode
+  int      seen;
+  uint32_t next_frame;
+  uint64_t frames;
+  uint64_t events;
+  uint64_t lost;
+  uint64_t late;
+  int      keys_down;   // Key state as applied in arrival order
+} lg_client;
+
+typedef struct {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t errors;      // Send errors, or decode/verify errors when sinking
+  uint64_t lat_sum;
+  uint64_t lat_num;
+  uint32_t lat_max;
+  uint32_t lat_hist[32]; // log2 buckets in microseconds
+} lg_stats;
+
+static lg_client clients[MAX_CLIENTS];
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+static void show_usage(const char *arg0)
+{
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: %s [-s [-K]] [-n <clients>] [-c <firstID>] [-r <rate>] [-m <keyPct>]\n", arg0);
+  fprintf(stderr, "          [-d <secs>] [-k <encKey>] [-p <port>] [-i <iface>] [-g <group>]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         Sends synthetic events for <clients> client IDs starting at\n");
+  fprintf(stderr, "         <firstID>, or receives and checks them in sink mode.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         -s           : Sink mode, count, verify and time received events.\n");
+  fprintf(stderr, "         -K           : In sink mode, exit with status 2 if keys are\n");
+  fprintf(stderr, "                        still held down at the end.\n");
+  fprintf(stderr, "         -n <clients> : Number of client IDs, default 1.\n");
+  fprintf(stderr, "         -c <firstID> : First client ID, default 1.\n");
+  fprintf(stderr, "         -r <rate>    : Frames per second and client, default 125.\n");
+  fprintf(stderr, "         -m <keyPct>  : Percentage of key frames, the rest is mouse\n");
+  fprintf(stderr, "                        motion, default 10.\n");
+  fprintf(stderr, "         -d <secs>    : Stop after <secs> seconds, default runs until ^C.\n");
+  fprintf(stderr, "         -k <encKey>  : Encrypt/decrypt with <encKey>.\n");
+  fprintf(stderr, "         -p <port>    : Use <port> instead of default port 4020.\n");
+  fprintf(stderr, "         -i <iface>   : Use local interface <iface>, given by IP address.\n");
+  fprintf(stderr, "         -g <group>   : Multicast group address.\n");
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Send time of a packet, see above.
+static uint32_t send_stamp(uint64_t us)
+{
+  return (uint32_t)(us % 1000) << 16 | (uint32_t)(us / 1000 & STAMP_MASK);
+}
+
+// Microseconds since a packet with this stamp was sent.
+static uint32_t stamp_age(uint32_t rnd, uint64_t now)
+{
+  uint64_t sent = (uint64_t)(rnd & STAMP_MASK) * 1000 + (rnd >> 16);
+  return (uint32_t)((now % STAMP_PERIOD_US + STAMP_PERIOD_US - sent) % STAMP_PERIOD_US);
+}
+
+static void add_latency(lg_stats *stats, uint32_t us)
+{
+  int bucket = 0;
+  while (bucket < 31 && (1u << (bucket + 1)) <= us) bucket++;
+  stats->lat_hist[bucket]++;
+  stats->lat_sum += us;
+  stats->lat_num++;
+  if (us > stats->lat_max) stats->lat_max = us;
+}
+
+// Upper bound of the bucket holding the given percentile.
+static uint32_t percentile(lg_stats *stats, int pct)
+{
+  uint64_t want = (stats->lat_num * pct + 99) / 100;
+  uint64_t have = 0;
+  for (int b = 0; b < 32; b++) {
+    have += stats->lat_hist[b];
+    if (have >= want && have) return 2u << b;
+  }
+  return 0;
+}
+
+static void send_event(int sockfd, struct sockaddr_in *addr, const char *key, lg_stats *stats,
+                      int client_id, uint16_t type, uint16_t code, int32_t value)
+{
+  struct em_packet packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.clientIdx = client_id;
+  packet.rnd       = send_stamp(now_us());
+  packet.type      = type;
+  packet.code      = code;
+  packet.value     = value;
+  size_t len = MIN_PACKET_SIZE;
+
+  if (key) {
+    size_t enclen;
+    unsigned char *encdata = xxtea_encrypt(&(packet.rnd), MIN_PACKET_SIZE - 2, key, &enclen);
+    if (!encdata || enclen != MAX_PACKET_SIZE - 2) {
+      fprintf(stderr, "Encrypting packet failed.\n");
+      exit(-1);
+    }
+    memcpy(&(packet.rnd), encdata, enclen);
+    free(encdata);
+    packet.enc = MAX_PACKET_SIZE - 2;
+    len = MAX_PACKET_SIZE;
+  }
+
+  if (sendto(sockfd, &packet, len, 0, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    stats->errors++;
+    return;
+  }
+  stats->packets++;
+  stats->bytes += len;
+}
+
+static void print_send_stats(lg_stats *stats, double secs)
+{
+  printf("sent %llu packets (%.0f/s, %.1f kB/s), %llu send errors\n",
+    (unsigned long long)stats->packets, stats->packets / secs, stats->bytes / secs / 1000,
+    (unsigned long long)stats->errors);
+}
+
+static void run_send(int sockfd, struct sockaddr_in *addr, const char *key,
+                     int first, int num, int rate, int key_pct, int duration)
+{
+  lg_stats total, interval;
+  memset(&total, 0, sizeof(total));
+  memset(&interval, 0, sizeof(interval));
+
+  uint64_t period = 1000000 / rate;
+  uint64_t start = now_us();
+  uint64_t last_report = start;
+
+  // Spread clients over one period so they don't all fire at once.
+  for (int c = 0; c < num; c++) {
+    clients[c].next_due = start + period * c / num;
+  }
+
+  while (!quit) {
+    uint64_t now = now_us();
+    uint64_t next = now + period;
+
+    for (int c = 0; c < num; c++) {
+      lg_client *client = &clients[c];
+      int id = first + c;
+
+      while (client->next_due <= now) {
+        if ((int)(random() % 100) < key_pct) {
+          client->key_down = !client->key_down;
+          send_event(sockfd, addr, key, &interval, id, EV_KEY, KEY_A + (id % 26), client->key_down);
+        }
+        else {
+          send_event(sockfd, addr, key, &interval, id, EV_REL, REL_X, (random() % 7) - 3);
+          send_event(sockfd, addr, key, &interval, id, EV_REL, REL_Y, (random() % 7) - 3);
+        }
+        send_event(sockfd, addr, key, &interval, id, EV_SYN, SYN_REPORT, client->frame);
+        client->frame++;
+        client->next_due += period;
+      }
+      if (client->next_due < next) next = client->next_due;
+    }
+
+    now = now_us();
+    if (now - last_report >= 1000000) {
+      print_send_stats(&interval, (now - last_report) / 1e6);
+      total.packets += interval.packets;
+      total.bytes   += interval.bytes;
+      total.errors  += interval.errors;
+      memset(&interval, 0, sizeof(interval));
+      last_report = now;
+    }
+    if (duration && now - start >= (uint64_t)duration * 1000000) break;
+
+    if (next > now) {
+      struct timespec ts = { .tv_sec = (next - now) / 1000000, .tv_nsec = ((next - now) % 1000000) * 1000 };
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  // Leave nothing held down on the receiving side.
+  for (int c = 0; c < num; c++) {
+    lg_client *client = &clients[c];
+    int id = first + c;
+    if (!client->key_down) continue;
+    client->key_down = 0;
+    send_event(sockfd, addr, key, &interval, id, EV_KEY, KEY_A + (id % 26), 0);
+    send_event(sockfd, addr, key, &interval, id, EV_SYN, SYN_REPORT, client->frame);
+    client->frame++;
+  }
+
+  total.packets += interval.packets;
+  total.bytes   += interval.bytes;
+  total.errors  += interval.errors;
+  printf("Total: ");
+  print_send_stats(&total, (now_us() - start) / 1e6);
+}
+
+// Packet and latency figures are per interval, per client counters are
+// totals since start.
+static int print_sink_stats(lg_stats *stats, double secs, int first, int num)
+{
+  uint64_t frames = 0, events = 0, lost = 0, late = 0;
+  int seen = 0, keys_down = 0;
+  for (int c = 0; c < num; c++) {
+    lg_client *client = &clients[first + c];
+    frames += client->frames;
+    events += client->events;
+    lost   += client->lost;
+    late   += client->late;
+    seen   += client->seen;
+    keys_down += client->keys_down;
+  }
+
+  printf("recv %llu packets (%.0f/s), %d clients, %llu frames, %llu events, %llu lost, %llu reordered, %llu bad, %d keys down",
+    (unsigned long long)stats->packets, stats->packets / secs, seen,
+    (unsigned long long)frames, (unsigned long long)events,
+    (unsigned long long)lost, (unsigned long long)late, (unsigned long long)stats->errors, keys_down);
+  if (stats->lat_num)
+    printf(", latency avg %lluus p50 <%uus p90 <%uus p99 <%uus max %uus",
+      (unsigned long long)(stats->lat_sum / stats->lat_num),
+      percentile(stats, 50), percentile(stats, 90), percentile(stats, 99), stats->lat_max);
+  printf("\n");
+  return keys_down;
+}
+
+// Returns the number of keys left down.
+static int run_sink(int sockfd, const char *key, int first, int num, int duration)
+{
+  lg_stats total, interval;
+  memset(&total, 0, sizeof(total));
+  memset(&interval, 0, sizeof(interval));
+
+  uint64_t start = now_us();
+  uint64_t last_report = start;
+
+  while (!quit) {
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+    int rc = poll(&pfd, 1, 100);
+    uint64_t now = now_us();
+
+    if (rc > 0) {
+      while (1) {
+        struct em_packet packet;
+        ssize_t n = recv(sockfd, &packet, sizeof(packet), MSG_DONTWAIT);
+        if (n < 0) break;
+        now = now_us();
+        interval.packets++;
+
+        if (n < MIN_PACKET_SIZE || packet.clientIdx < first || packet.clientIdx >= first + num) {
+          interval.errors++;
+          continue;
+        }
+
+        if (packet.enc) {
+          size_t declen;
+          unsigned char *decrypt_data = key ? xxtea_decrypt(&(packet.rnd), packet.enc, key, &declen) : NULL;
+          if (!decrypt_data || declen != MIN_PACKET_SIZE - 2) {
+            free(decrypt_data);
+            interval.errors++;
+            continue;
+          }
+          memcpy(&(packet.rnd), decrypt_data, declen);
+          free(decrypt_data);
+        }
+        else if (key) {
+          interval.errors++;
+          continue;
+        }
+
+        lg_client *client = &clients[packet.clientIdx];
+        if (packet.type != EV_KEY && packet.type != EV_REL && packet.type != EV_SYN) {
+          interval.errors++;
+          continue;
+        }
+        client->events++;
+        add_latency(&interval, stamp_age(packet.rnd, now));
+        if (packet.type == EV_KEY) client->keys_down = packet.value != 0;
+
+        if (packet.type == EV_SYN) {
+          uint32_t frame = packet.value;
+          if (client->seen && frame != client->next_frame) {
+            if ((int32_t)(frame - client->next_frame) > 0) client->lost += frame - client->next_frame;
+            else client->late++;
+          }
+          if (!client->seen || (int32_t)(frame - client->next_frame) >= 0) client->next_frame = frame + 1;
+          client->seen = 1;
+          client->frames++;
+        }
+      }
+    }
+
+    if (now - last_report >= 1000000) {
+      print_sink_stats(&interval, (now - last_report) / 1e6, first, num);
+      total.packets += interval.packets;
+      total.errors  += interval.errors;
+      total.lat_sum += interval.lat_sum;
+      total.lat_num += interval.lat_num;
+      if (interval.lat_max > total.lat_max) total.lat_max = interval.lat_max;
+      for (int b = 0; b < 32; b++) total.lat_hist[b] += interval.lat_hist[b];
+      memset(&interval, 0, sizeof(interval));
+      last_report = now;
+    }
+    if (duration && now - start >= (uint64_t)duration * 1000000) break;
+  }
+
+  total.packets += interval.packets;
+  total.errors  += interval.errors;
+  total.lat_sum += interval.lat_sum;
+  total.lat_num += interval.lat_num;
+  if (interval.lat_max > total.lat_max) total.lat_max = interval.lat_max;
+  for (int b = 0; b < 32; b++) total.lat_hist[b] += interval.lat_hist[b];
+  printf("Total: ");
+  return print_sink_stats(&total, (now_us() - start) / 1e6, first, num);
+}
+
+int main(int argc, char*argv[]) {
+  // Command line options
+  int              sink = 0;
+  int        check_keys = 0;
+  int        num_client = 1;
+  int         client_id = 1;
+  int              rate = 125;
+  int           key_pct = 10;
+  int          duration = 0;
+  char *multicast_group = NULL;
+  char  *encryption_key = NULL;
+  in_addr_t   interface = INADDR_ANY;
+  uint16_t         port = DEFAULT_PORT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "sKn:c:r:m:d:k:p:i:g:")) != -1) {
+    switch (opt) {
+    case 's':
+      sink = 1;
+      break;
+    case 'K':
+      check_keys = 1;
+      break;
+    case 'n':
+      num_client = atoi(optarg);
+      break;
+    case 'c':
+      client_id = atoi(optarg);
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'm':
+      key_pct = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'k':
+      encryption_key = strdup(optarg);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (!port) show_usage(argv[0]);
+      break;
+    case 'i':
+      interface = inet_addr(optarg);
+      if (interface == INADDR_NONE) show_usage(argv[0]);
+      break;
+    case 'g':
+      multicast_group = strdup(optarg);
+      break;
+    default:
+      show_usage(argv[0]);
+    }
+  }
+  if (optind < argc) show_usage(argv[0]);
+  if (client_id < 0 || num_client < 1 || client_id + num_client > MAX_CLIENTS) {
+    fprintf(stderr, "Client IDs must be between 0 and %d\n", MAX_CLIENTS - 1);
+    show_usage(argv[0]);
+  }
+  if (rate < 1 || rate > 1000000 || key_pct < 0 || key_pct > 100 || duration < 0)
+    show_usage(argv[0]);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    perror("socket");
+    exit(-1);
+  }
+
+  struct sockaddr_in addr;
+  memset((void *)&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP);
+  addr.sin_port = htons(port);
+
+  srandom(time(NULL) ^ getpid());
+
+  if (sink) {
+    int one = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in servaddr;
+    memset((void *)&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+      perror("bind");
+      exit(-1);
+    }
+
+    struct ip_mreq imreq;
+    memset(&imreq, 0, sizeof(imreq));
+    imreq.imr_multiaddr.s_addr = addr.sin_addr.s_addr;
+    imreq.imr_interface.s_addr = interface;
+    if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imreq, sizeof(imreq)) < 0) {
+      perror("IP_ADD_MEMBERSHIP");
+      exit(-1);
+    }
+
+    printf("Sinking client IDs #%d-#%d at %s:%u, encryption %s\n", client_id, client_id + num_client - 1,
+      multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP, port, encryption_key ? "enabled" : "disabled");
+    if (run_sink(sockfd, encryption_key, client_id, num_client, duration) && check_keys) return 2;
+  }
+  else {
+    if (interface != INADDR_ANY) {
+      struct in_addr ifaddr = { .s_addr = interface };
+      setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+    }
+
+    printf("Sending for client IDs #%d-#%d to %s:%u, %d frames/s each, %d%% keys, encryption %s\n",
+      client_id, client_id + num_client - 1, multicast_group ? multicast_group : DEFAULT_MULTICAST_GROUP,
+      port, rate, key_pct, encryption_key ? "enabled" : "disabled");
+    run_send(sockfd, &addr, encryption_key, client_id, num_client, rate, key_pct, duration);
+  }
+
+  return 0;
+}
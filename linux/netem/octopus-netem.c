@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Network impairment proxy for testing. Receives the event stream on the
+// multicast group at <inPort> and forwards it to the same group at
+// <outPort>, losing, duplicating, delaying and reordering packets on the
+// way. Presence announcements travel back from <outPort> + 1 to
+// <inPort> + 1 untouched, so presence tracking keeps working.
+//
+//   server / octopus-loadgen --> :inPort  [octopus-netem]  :outPort --> client / sink
+//
+// Everything runs on one host, senders need multicast loopback enabled.
+// With -S the impairments are reproducible.
+
+#define DEFAULT_MULTICAST_GROUP "239.255.77.88"
+#define DEFAULT_IN_PORT 4020
+#define DEFAULT_OUT_PORT 4030
+
+#define MAX_DATAGRAM_SIZE 64
+#define MAX_PENDING 4096
+
+#define DIST_UNIFORM 0
+#define DIST_NORMAL  1
+#define DIST_PARETO  2
+
+typedef struct {
+  uint64_t due;       // Microseconds
+  uint64_t seq;       // Arrival order
+  size_t   len;
+  uint8_t  buf[MAX_DATAGRAM_SIZE];
+} ne_packet;
+
+typedef struct {
+  double   loss;      // Probabilities, 0..1
+  double   burst;     // Mean length of loss bursts, 1 for independent losses
+  double   dup;
+  double   reorder;
+  int      reorder_us; // Extra delay for reordered packets
+  int      delay_us;
+  int      jitter_us;
+  int      dist;
+} ne_config;
+
+typedef struct {
+  uint64_t received;
+  uint64_t sent;
+  uint64_t lost;
+  uint64_t duplicated;
+  uint64_t reordered; // Sent after a packet that arrived later
+  uint64_t overflow;
+  uint64_t presence;
+} ne_stats;
+
+static ne_packet pending[MAX_PENDING];  // Sorted by due time
+static int num_pending = 0;
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+static void show_usage(const char *arg0)
+{
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: %s [-i <inPort>] [-o <outPort>] [-g <group>] [-l <pct>] [-b <len>]\n", arg0);
+  fprintf(stderr, "          [-u <pct>] [-r <pct>] [-R <ms>] [-D <ms>] [-J <ms>] [-t <dist>]\n");
+  fprintf(stderr, "          [-S <seed>] [-d <secs>]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         Forwards octopus packets from <inPort> to <outPort> on the\n");
+  fprintf(stderr, "         multicast group and impairs them on the way.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         -i <inPort>  : Port the sender uses, default 4020.\n");
+  fprintf(stderr, "         -o <outPort> : Port the receiver listens on, default 4030.\n");
+  fprintf(stderr, "         -g <group>   : Multicast group address.\n");
+  fprintf(stderr, "         -l <pct>     : Lose <pct> percent of the packets.\n");
+  fprintf(stderr, "         -b <len>     : Lose packets in bursts of <len> on average,\n");
+  fprintf(stderr, "                        default 1 (independent losses).\n");
+  fprintf(stderr, "         -u <pct>     : Duplicate <pct> percent of the packets.\n");
+  fprintf(stderr, "         -r <pct>     : Hold back <pct> percent of the packets so later\n");
+  fprintf(stderr, "                        ones overtake them.\n");
+  fprintf(stderr, "         -R <ms>      : How long reordered packets are held, default 5.\n");
+  fprintf(stderr, "         -D <ms>      : Delay all packets by <ms>.\n");
+  fprintf(stderr, "         -J <ms>      : Add random delay of up to/around <ms>.\n");
+  fprintf(stderr, "         -t <dist>    : Jitter distribution: uniform (0..J), normal\n");
+  fprintf(stderr, "                        (sigma J) or pareto (scale J, heavy tail).\n");
+  fprintf(stderr, "         -S <seed>    : Random seed, for repeatable runs.\n");
+  fprintf(stderr, "         -d <secs>    : Stop after <secs> seconds, default runs until ^C.\n");
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double uniform()
+{
+  return (random() + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+static int chance(double p)
+{
+  return p > 0 && uniform() < p;
+}
+
+static int jitter_sample(ne_config *cfg)
+{
+  if (!cfg->jitter_us) return 0;
+  double v;
+  switch (cfg->dist) {
+  case DIST_NORMAL:
+    // Box-Muller, negative samples are clipped to no extra delay.
+    v = sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform()) * cfg->jitter_us;
+    break;
+  case DIST_PARETO:
+    // Shape 2: finite mean (2 * scale), long tail.
+    v = cfg->jitter_us / sqrt(uniform()) - cfg->jitter_us;
+    break;
+  default:
+    v = uniform() * cfg->jitter_us;
+  }
+  return v > 0 ? (int)v : 0;
+}
+
+// Gilbert model: after a loss, stay in the lossy state with a
+// probability that gives bursts of the configured mean length.
+static int lose_packet(ne_config *cfg)
+{
+  static int in_burst = 0;
+  if (in_burst && cfg->burst > 1 && chance(1.0 - 1.0 / cfg->burst)) return 1;
+  in_burst = 0;
+
+  // Entering a burst less often keeps the overall loss rate.
+  double p = cfg->burst > 1 ? cfg->loss / cfg->burst : cfg->loss;
+  if (chance(p)) {
+    in_burst = 1;
+    return 1;
+  }
+  return 0;
+}
+
+static void enqueue(ne_stats *stats, uint64_t due, uint64_t seq, uint8_t *buf, size_t len)
+{
+  if (num_pending == MAX_PENDING) {
+    stats->overflow++;
+    return;
+  }
+  int i = num_pending;
+  while (i > 0 && pending[i - 1].due > due) i--;
+  memmove(&pending[i + 1], &pending[i], (num_pending - i) * sizeof(pending[0]));
+  pending[i].due = due;
+  pending[i].seq = seq;
+  pending[i].len = len;
+  memcpy(pending[i].buf, buf, len);
+  num_pending++;
+}
+
+// Send what is due. Returns microseconds until the next packet, or -1.
+static int64_t release_due(int sockfd, struct sockaddr_in *out, ne_stats *stats, uint64_t *last_seq)
+{
+  uint64_t now = now_us();
+  int done = 0;
+  while (done < num_pending && pending[done].due <= now) {
+    ne_packet *packet = &pending[done++];
+    if (sendto(sockfd, packet->buf, packet->len, 0, (struct sockaddr *)out, sizeof(*out)) < 0) continue;
+    stats->sent++;
+    if (packet->seq < *last_seq) stats->reordered++;
+    else *last_seq = packet->seq;
+  }
+  if (done) {
+    num_pending -= done;
+    memmove(&pending[0], &pending[done], num_pending * sizeof(pending[0]));
+  }
+  return num_pending ? (int64_t)(pending[0].due - now) : -1;
+}
+
+static void print_stats(ne_stats *stats)
+{
+  printf("recv %llu, sent %llu, lost %llu, duplicated %llu, reordered %llu, overflow %llu, presence %llu\n",
+    (unsigned long long)stats->received, (unsigned long long)stats->sent,
+    (unsigned long long)stats->lost, (unsigned long long)stats->duplicated,
+    (unsigned long long)stats->reordered, (unsigned long long)stats->overflow,
+    (unsigned long long)stats->presence);
+  fflush(stdout);
+}
+
+static int open_listener(in_addr_t group, uint16_t port)
+{
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    perror("socket");
+    exit(-1);
+  }
+  int one = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset((void *)&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(-1);
+  }
+
+  struct ip_mreq imreq;
+  memset(&imreq, 0, sizeof(imreq));
+  imreq.imr_multiaddr.s_addr = group;
+  imreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imreq, sizeof(imreq)) < 0) {
+    perror("IP_ADD_MEMBERSHIP");
+    exit(-1);
+  }
+  return sockfd;
+}
+
+static double parse_pct(const char *arg0, const char *arg)
+{
+  double pct = atof(arg);
+  if (pct < 0 || pct > 100) show_usage(arg0);
+  return pct / 100.0;
+}
+
+int main(int argc, char*argv[]) {
+  // Command line options
+  char *multicast_group = DEFAULT_MULTICAST_GROUP;
+  uint16_t      in_port = DEFAULT_IN_PORT;
+  uint16_t     out_port = DEFAULT_OUT_PORT;
+  unsigned int     seed = time(NULL) ^ getpid();
+  int          duration = 0;
+  ne_config cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.burst = 1;
+  cfg.reorder_us = 5000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:g:l:b:u:r:R:D:J:t:S:d:")) != -1) {
+    switch (opt) {
+    case 'i':
+      in_port = atoi(optarg);
+      if (!in_port) show_usage(argv[0]);
+      break;
+    case 'o':
+      out_port = atoi(optarg);
+      if (!out_port) show_usage(argv[0]);
+      break;
+    case 'g':
+      multicast_group = strdup(optarg);
+      break;
+    case 'l':
+      cfg.loss = parse_pct(argv[0], optarg);
+      break;
+    case 'b':
+      cfg.burst = atof(optarg);
+      if (cfg.burst < 1) show_usage(argv[0]);
+      break;
+    case 'u':
+      cfg.dup = parse_pct(argv[0], optarg);
+      break;
+    case 'r':
+      cfg.reorder = parse_pct(argv[0], optarg);
+      break;
+    case 'R':
+      cfg.reorder_us = atof(optarg) * 1000;
+      if (cfg.reorder_us < 0) show_usage(argv[0]);
+      break;
+    case 'D':
+      cfg.delay_us = atof(optarg) * 1000;
+      if (cfg.delay_us < 0) show_usage(argv[0]);
+      break;
+    case 'J':
+      cfg.jitter_us = atof(optarg) * 1000;
+      if (cfg.jitter_us < 0) show_usage(argv[0]);
+      break;
+    case 't':
+      if (!strcmp(optarg, "uniform")) cfg.dist = DIST_UNIFORM;
+      else if (!strcmp(optarg, "normal")) cfg.dist = DIST_NORMAL;
+      else if (!strcmp(optarg, "pareto")) cfg.dist = DIST_PARETO;
+      else show_usage(argv[0]);
+      break;
+    case 'S':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      if (duration < 0) show_usage(argv[0]);
+      break;
+    default:
+      show_usage(argv[0]);
+    }
+  }
+  if (optind < argc || in_port == out_port || in_port + 1 == out_port || out_port + 1 == in_port)
+    show_usage(argv[0]);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  in_addr_t group = inet_addr(multicast_group);
+  int in_sock = open_listener(group, in_port);
+  int presence_sock = open_listener(group, out_port + 1);
+  int out_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (out_sock < 0) {
+    perror("socket");
+    exit(-1);
+  }
+  int one = 1;
+  setsockopt(out_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one));
+
+  struct sockaddr_in out_addr, back_addr;
+  memset((void *)&out_addr, 0, sizeof(out_addr));
+  out_addr.sin_family = AF_INET;
+  out_addr.sin_addr.s_addr = group;
+  out_addr.sin_port = htons(out_port);
+  back_addr = out_addr;
+  back_addr.sin_port = htons(in_port + 1);
+
+  srandom(seed);
+  printf("Forwarding %s:%u to port %u, seed %u: loss %.1f%% (bursts of %.1f), dup %.1f%%, reorder %.1f%% (+%dms), delay %dms + %dms %s jitter\n",
+    multicast_group, in_port, out_port, seed, cfg.loss * 100, cfg.burst, cfg.dup * 100,
+    cfg.reorder * 100, cfg.reorder_us / 1000, cfg.delay_us / 1000, cfg.jitter_us / 1000,
+    cfg.dist == DIST_NORMAL ? "normal" : cfg.dist == DIST_PARETO ? "pareto" : "uniform");
+  fflush(stdout);
+
+  ne_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  uint64_t seq = 0, last_seq = 0;
+  uint64_t start = now_us();
+  uint64_t last_report = start;
+
+  while (!quit) {
+    int64_t wait_us = release_due(out_sock, &out_addr, &stats, &last_seq);
+    int timeout = 100;
+    if (wait_us >= 0 && wait_us / 1000 < timeout) timeout = wait_us / 1000;
+
+    struct pollfd pfds[2] = {
+      { .fd = in_sock, .events = POLLIN },
+      { .fd = presence_sock, .events = POLLIN },
+    };
+    int rc = poll(pfds, 2, timeout);
+
+    if (rc > 0 && (pfds[1].revents & POLLIN)) {
+      uint8_t buf[MAX_DATAGRAM_SIZE];
+      ssize_t n = recv(presence_sock, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n > 0 && sendto(out_sock, buf, n, 0, (struct sockaddr *)&back_addr, sizeof(back_addr)) >= 0)
+        stats.presence++;
+    }
+
+    while (rc > 0 && (pfds[0].revents & POLLIN)) {
+      uint8_t buf[MAX_DATAGRAM_SIZE];
+      ssize_t n = recv(in_sock, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n < 0) break;
+      uint64_t now = now_us();
+      stats.received++;
+      seq++;
+
+      if (lose_packet(&cfg)) {
+        stats.lost++;
+        continue;
+      }
+
+      int copies = 1;
+      if (chance(cfg.dup)) {
+        copies = 2;
+        stats.duplicated++;
+      }
+      for (int c = 0; c < copies; c++) {
+        uint64_t due = now + cfg.delay_us + jitter_sample(&cfg);
+        if (chance(cfg.reorder)) due += cfg.reorder_us;
+        enqueue(&stats, due, seq, buf, n);
+      }
+    }
+
+    uint64_t now = now_us();
+    if (now - last_report >= 1000000) {
+      print_stats(&stats);
+      last_report = now;
+    }
+    if (duration && now - start >= (uint64_t)duration * 1000000) break;
+  }
+
+  // Whatever is still in flight arrives late rather than never.
+  while (num_pending) {
+    int64_t wait_us = release_due(out_sock, &out_addr, &stats, &last_seq);
+    if (wait_us > 0) usleep(wait_us);
+  }
+
+  printf("Total: ");
+  print_stats(&stats);
+  return 0;
+}
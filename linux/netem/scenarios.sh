@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# Runs octopus-loadgen through octopus-netem under a set of impairment
+# scenarios on loopback and checks what arrives at a sink:
+#
+#   octopus-loadgen --> :4020  octopus-netem  :4030 --> octopus-loadgen -s -K
+#
+# Each scenario either asserts that the sink ends with no key held down
+# ("keys") or only reports ("report"). Latency percentiles include the
+# delay netem adds on purpose.
+#
+# Usage: scenarios.sh [scenario...]   (default: all)
+#
+# Environment: SECS (send duration, default 5), RATE (frames/s per client,
+# default 250), CLIENTS (default 4), KEYPCT (default 30), SEED (default 1).
+
+cd "$(dirname "$0")/.."
+
+LOADGEN=loadgen/octopus-loadgen
+NETEM=netem/octopus-netem
+IN_PORT=4020
+OUT_PORT=4030
+
+SECS=${SECS:-5}
+RATE=${RATE:-250}
+CLIENTS=${CLIENTS:-4}
+KEYPCT=${KEYPCT:-30}
+SEED=${SEED:-1}
+SELECTED="$*"
+
+#        name           expect  netem options
+SCENARIOS=(
+  "clean            keys"
+  "delay            keys    -D 20"
+  "duplicate        keys    -u 5"
+  "loss             report  -l 1"
+  "burst-loss       report  -l 2 -b 8"
+  "reorder          report  -r 5 -R 3"
+  "jitter           report  -D 5 -J 10 -t pareto"
+  "wifi             report  -l 1 -b 3 -u 1 -r 2 -D 3 -J 5 -t pareto"
+)
+
+for tool in $LOADGEN $NETEM; do
+  if [ ! -x $tool ]; then
+    echo "$tool not built, run make first."
+    exit 1
+  fi
+done
+
+run_scenario() {
+  local name=$1 expect=$2
+  shift 2
+
+  local sink_log=$(mktemp) netem_log=$(mktemp)
+
+  # The sink outlives the sender, so delayed packets still count.
+  $LOADGEN -s -K -n $CLIENTS -p $OUT_PORT -d $((SECS + 2)) > $sink_log &
+  local sink=$!
+  $NETEM -i $IN_PORT -o $OUT_PORT -S $SEED -d $((SECS + 1)) "$@" > $netem_log &
+  local netem=$!
+  sleep 0.5
+
+  $LOADGEN -n $CLIENTS -p $IN_PORT -r $RATE -m $KEYPCT -d $SECS > /dev/null
+  wait $netem
+  wait $sink
+  local rc=$?
+
+  local result=PASS
+  if [ $rc -eq 2 ] && [ $expect = keys ]; then
+    result=FAIL
+  elif [ $rc -ne 0 ] && [ $rc -ne 2 ]; then
+    result=ERROR
+  fi
+  [ $expect = report ] && [ $result = PASS ] && result=REPORT
+
+  printf "%-12s %-6s %s\n" "$name" "$result" "$*"
+  printf "  netem: %s\n" "$(grep '^Total' $netem_log | sed 's/^Total: //')"
+  printf "  sink:  %s\n" "$(grep '^Total' $sink_log | sed 's/^Total: //')"
+  rm -f $sink_log $netem_log
+
+  [ $result != FAIL ] && [ $result != ERROR ]
+}
+
+failed=0
+for scenario in "${SCENARIOS[@]}"; do
+  set -- $scenario
+  name=$1
+  if [ -n "$SELECTED" ] && [[ " $SELECTED " != *" $name "* ]]; then
+    continue
+  fi
+  run_scenario "$@" || failed=$((failed + 1))
+done
+
+if [ $failed -gt 0 ]; then
+  echo "$failed scenario(s) failed."
+  exit 1
+fi
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -16,15 +17,32 @@
 
 #include "octopus-server.h"
 
-#define JSMN_NUM_TOKENS 128
-#define JSMN_CFG_SIZE 16384
-
-char jsmn_cfg[JSMN_CFG_SIZE];
+// Config file contents and token count, both sized from the file.
+char *jsmn_cfg = NULL;
+int   jsmn_num_tokens = 0;
+
+// Everything a parsed config consists of lives in one arena, see em_config.
+char  *jsmn_arena = NULL;
+size_t jsmn_arena_size = 0;
+size_t jsmn_arena_used = 0;
+
+// Token array of the parse in progress. Both it and the arena are left
+// behind when em_fatal() bails out of a reload, see jsmn_cfg_abort().
+jsmntok_t *jsmn_tokens = NULL;
+
+void* jsmn_arena_alloc(size_t size) {
+    size = (size + 15) & ~((size_t)15);
+    if (jsmn_arena_used + size > jsmn_arena_size)
+        em_fatal("Config: arena of %zu bytes exhausted.", jsmn_arena_size);
+    void *p = &jsmn_arena[jsmn_arena_used];
+    jsmn_arena_used += size;
+    return p;
+}
 
 char *jsmn_tmp_value_p = NULL;
 char* jsmn_tmp_value(jsmntok_t token) {
     if (jsmn_tmp_value_p) free(jsmn_tmp_value_p);
-    char *jsmn_tmp_value_p = em_malloc(token.end - token.start + 1);
+    jsmn_tmp_value_p = em_malloc(token.end - token.start + 1);
     memcpy(jsmn_tmp_value_p, &jsmn_cfg[token.start], token.end - token.start);
     jsmn_tmp_value_p[token.end - token.start] = '\0';
     return jsmn_tmp_value_p;
@@ -35,141 +53,366 @@ int jsmn_cmp_value(char *str, jsmntok_t token) {
 }
 
 char* jsmn_get_value(jsmntok_t token) {
-    char *str = em_malloc(token.end - token.start + 1);
+    char *str = jsmn_arena_alloc(token.end - token.start + 1);
     memcpy(str, &jsmn_cfg[token.start], token.end - token.start);
     str[token.end - token.start] = '\0';
     return str;
 }
 
+// Vendor and product IDs, as four lowercase hex digits. Plain numbers
+// may be given in any base strtol() accepts, patterns are taken as hex.
+char* jsmn_get_id(jsmntok_t token) {
+    char *str = jsmn_get_value(token);
+    if (strpbrk(str, "*?[")) {
+        if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) str += 2;
+        for (char *c = str; *c; c++) *c = tolower(*c);
+        return str;
+    }
+
+    char *end;
+    long id = strtol(str, &end, 0);
+    if (*end || end == str || id < 0 || id > 0xffff)
+        em_fatal("Config: invalid device id '%s'.", str);
+    str = jsmn_arena_alloc(5);
+    snprintf(str, 5, "%04lx", id);
+    return str;
+}
+
+// Index of the group called name in config->groups, -1 if there is none.
+int jsmn_group_by_name(em_config *config, char *name) {
+    for (int g = 0; g < config->num_groups; g++) {
+        if (strcmp(config->groups[g].name, name) == 0) return g;
+    }
+    return -1;
+}
+
+// "drop_events": [ "EV_MSC", "KEY_CAPSLOCK", ... ] at array_tnum into filter.
+// EV_* names drop the whole type, code names only that code of their type.
+void jsmn_get_filter(jsmntok_t *tokens, int array_tnum, em_filter *filter) {
+    for (int event_num = 0; event_num < tokens[array_tnum].size; event_num++) {
+        int event_tnum = array_tnum + event_num + 1;
+        if (tokens[event_tnum].type != JSMN_STRING)
+            em_fatal("Config: event specifiers must be given as quoted strings.");
+        char *tmpval = jsmn_tmp_value(tokens[event_tnum]);
+
+        int type, code = -1;
+        if (strncmp(tmpval, "EV_", 3) == 0) type = libevdev_event_type_from_name(tmpval);
+        else {
+            type = em_event_type_from_code_name(tmpval);
+            if (type >= 0) code = libevdev_event_code_from_name(type, tmpval);
+            if (code < 0 || code >= KEY_CNT) type = -1;
+        }
+        if (type < 0 || type >= EV_CNT) em_fatal("Config: unknown event '%s'.", tmpval);
+        if (type == EV_SYN) em_fatal("Config: SYN events can't be dropped.");
+
+        if (code < 0) filter->types |= 1u << type;
+        else {
+            if (!filter->codes[type]) filter->codes[type] = jsmn_arena_alloc(EM_FILTER_BYTES);
+            filter->codes[type][code >> 3] |= 1 << (code & 7);
+        }
+    }
+}
+
 int jsmn_get_bool(jsmntok_t token) {
-    char *str = em_malloc(token.end - token.start + 1);
-    memcpy(str, &jsmn_cfg[token.start], token.end - token.start);
-    str[token.end - token.start] = '\0';
-    return (strcmp(str,"true") == 0) ? 1:0;
+    return (strcmp(jsmn_tmp_value(token), "true") == 0) ? 1:0;
 }
 
 int jsmn_get_int(jsmntok_t token) {
-    char *str = em_malloc(token.end - token.start + 1);
-    memcpy(str, &jsmn_cfg[token.start], token.end - token.start);
-    str[token.end - token.start] = '\0';
-    return atoi(str);
+    return atoi(jsmn_tmp_value(token));
 }
 
+// Returns the token following the (sub)tree starting at t.
 int jsmn_skip(jsmntok_t *tokens, int t) {
     int i = 0;
+    if (tokens[t].type == JSMN_OBJECT) i = tokens[t].size * 2;
+    if (tokens[t].type == JSMN_ARRAY)  i = tokens[t].size;
     t++;
-    if (t >= JSMN_NUM_TOKENS) return -1;
-    if (tokens[t-1].type == JSMN_OBJECT) i = tokens[t-1].size * 2;
-    if (tokens[t-1].type == JSMN_ARRAY)  i = tokens[t-1].size;
     while (i) {
+        if (t >= jsmn_num_tokens) return -1;
         t = jsmn_skip(tokens, t);
         if (t < 0) return -1;
         i--;
     }
-    return t < JSMN_NUM_TOKENS ? t : -1;
+    return t;
 }
 
+// Only looks at the keys of the object at t, not into nested or sibling objects.
 int jsmn_object_key_value(jsmntok_t *tokens, int t, char *key, jsmntype_t vtype) {
     if (tokens[t].type != JSMN_OBJECT) return -1;
+    int keys = tokens[t].size;
     t++;
-    while (t < JSMN_NUM_TOKENS) {
-        switch (tokens[t].type) {
-            case JSMN_STRING:
-            case JSMN_PRIMITIVE:
-                if (jsmn_cmp_value(key, tokens[t])
-                    && t+1 < JSMN_NUM_TOKENS
-                    && tokens[t+1].type == vtype) return t+1;
-            case JSMN_OBJECT:
-            case JSMN_ARRAY:
-                t = jsmn_skip(tokens, t);
-                if (t < 0) return -1;
-            break;
-            default: return -1;
-        }
+    while (keys--) {
+        if (t + 1 >= jsmn_num_tokens) return -1;
+        if (jsmn_cmp_value(key, tokens[t]) && tokens[t+1].type == vtype) return t+1;
+        t = jsmn_skip(tokens, t+1);
+        if (t < 0) return -1;
     }
-    return t < JSMN_NUM_TOKENS ? t : -1;
+    return -1;
 }
 
 int jsmn_array_index(jsmntok_t *tokens, int t, int index, jsmntype_t vtype) {
     if (tokens[t].type != JSMN_ARRAY) return -1;
-    if (index > tokens[t].size) return -1;
+    if (index >= tokens[t].size) return -1;
     t++;
-    if (t >= JSMN_NUM_TOKENS) return -1;
     while (index) {
+        if (t >= jsmn_num_tokens) return -1;
         t = jsmn_skip(tokens, t);
         if (t < 0) return -1;
         index--;
     }
-    if (t < JSMN_NUM_TOKENS && tokens[t].type == vtype) return t;
+    if (t < jsmn_num_tokens && tokens[t].type == vtype) return t;
     return -1;
 }
 
-void jsmn_cfg_parse(char *fname, em_device **devices_p, em_mapping **mappings_p, em_client **clients_p) {
+// Frees what a parse that didn't finish allocated.
+void jsmn_cfg_abort() {
+    free(jsmn_tokens);
+    free(jsmn_arena);
+    jsmn_tokens = NULL;
+    jsmn_arena  = NULL;
+}
+
+em_config *jsmn_cfg_parse(char *fname) {
+    jsmn_cfg_abort();
 
     int fd = open(fname, O_RDONLY);
     if (fd < 0) em_fatal("Unable to open config file");
-    int rc = read(fd, jsmn_cfg, JSMN_CFG_SIZE);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        em_fatal("Unable parse config file");
+    }
+    if (jsmn_cfg) free(jsmn_cfg);
+    jsmn_cfg = em_malloc(st.st_size + 1);
+    int len = 0;
+    while (len < st.st_size) {
+        int rc = read(fd, &jsmn_cfg[len], st.st_size - len);
+        if (rc <= 0) break;
+        len += rc;
+    }
     close(fd);
-    if (rc <= 0) em_fatal("Unable parse config file");
-    jsmn_cfg[rc] = '\0';
-
-    jsmntok_t tokens[JSMN_NUM_TOKENS];
-    memset(tokens, 0, sizeof(tokens));
+    if (len <= 0) em_fatal("Unable parse config file");
+    jsmn_cfg[len] = '\0';
 
+    // Count tokens first, then parse for real.
     jsmn_parser parser;
     jsmn_init(&parser);
-    if (jsmn_parse(&parser, jsmn_cfg, strlen(jsmn_cfg), tokens, JSMN_NUM_TOKENS) < 0 || tokens[0].type != JSMN_OBJECT)
+    jsmn_num_tokens = jsmn_parse(&parser, jsmn_cfg, len, NULL, 0);
+    if (jsmn_num_tokens <= 0) em_fatal("Config: Unable to parse config file.");
+
+    jsmntok_t *tokens = jsmn_tokens = em_malloc(jsmn_num_tokens * sizeof(jsmntok_t));
+    jsmn_init(&parser);
+    if (jsmn_parse(&parser, jsmn_cfg, len, tokens, jsmn_num_tokens) < 0 || tokens[0].type != JSMN_OBJECT)
         em_fatal("Config: Unable to parse config file.");
 
+    // Size all tables from the token tree.
+    int num_entries = 0, num_devices = 0, num_mappings = 0, num_clients = 0, num_groups = 0, num_outputs = 0, num_drops = 0, num_stages = 0;
+    int section_tnum = jsmn_object_key_value(tokens, 0, "devices", JSMN_ARRAY);
+    if (section_tnum > 0) {
+        num_entries = tokens[section_tnum].size;
+        for (int dev_num = 0; dev_num < num_entries; dev_num++) {
+            int device_tnum = jsmn_array_index(tokens, section_tnum, dev_num, JSMN_OBJECT);
+            if (device_tnum < 0) continue;
+            int nodes_tnum = jsmn_object_key_value(tokens, device_tnum, "nodes", JSMN_PRIMITIVE);
+            int nodes = nodes_tnum > 0 ? jsmn_get_int(tokens[nodes_tnum]) : EM_MAX_NODES;
+            if (nodes < 1 || nodes > EM_MAX_NODES)
+                em_fatal("Config: 'nodes' must be between 1 and %d.", EM_MAX_NODES);
+            // Room for all nodes, devices for them are only set up once
+            // they are found.
+            num_devices += nodes;
+            // Nodes of an entry share its filter.
+            int drop_tnum = jsmn_object_key_value(tokens, device_tnum, "drop_events", JSMN_ARRAY);
+            if (drop_tnum > 0) num_drops += tokens[drop_tnum].size;
+        }
+    }
+    section_tnum = jsmn_object_key_value(tokens, 0, "clients", JSMN_ARRAY);
+    if (section_tnum > 0) {
+        num_clients = tokens[section_tnum].size;
+        for (int client_num = 0; client_num < num_clients; client_num++) {
+            int client_tnum = jsmn_array_index(tokens, section_tnum, client_num, JSMN_OBJECT);
+            if (client_tnum < 0) continue;
+            int drop_tnum = jsmn_object_key_value(tokens, client_tnum, "drop_events", JSMN_ARRAY);
+            if (drop_tnum > 0) num_drops += tokens[drop_tnum].size;
+        }
+    }
+    section_tnum = jsmn_object_key_value(tokens, 0, "groups", JSMN_ARRAY);
+    if (section_tnum > 0) num_groups = tokens[section_tnum].size;
+    section_tnum = jsmn_object_key_value(tokens, 0, "mappings", JSMN_ARRAY);
+    if (section_tnum > 0) {
+        num_mappings = tokens[section_tnum].size;
+        for (int mapping_num = 0; mapping_num < num_mappings; mapping_num++) {
+            int mapping_tnum = jsmn_array_index(tokens, section_tnum, mapping_num, JSMN_OBJECT);
+            if (mapping_tnum < 0) continue;
+            int output_tnum = jsmn_object_key_value(tokens, mapping_tnum, "output", JSMN_ARRAY);
+            // Taps take two steps.
+            if (output_tnum > 0) num_outputs += 2 * tokens[output_tnum].size;
+        }
+    }
+    section_tnum = jsmn_object_key_value(tokens, 0, "stages", JSMN_ARRAY);
+    if (section_tnum > 0) num_stages = tokens[section_tnum].size;
+    if (num_entries > EM_MAX_DEVICES)
+        em_fatal("Config: At most %d devices are supported.", EM_MAX_DEVICES);
+    if (num_devices > EM_MAX_DEVICES) num_devices = EM_MAX_DEVICES;
+    if (num_stages > EM_MAX_STAGES)
+        em_fatal("Config: At most %d stages are supported.", EM_MAX_STAGES);
+    if (num_clients > EM_MAX_CLIENTS)
+        em_fatal("Config: At most %d clients are supported.", EM_MAX_CLIENTS);
+    if (num_groups > EM_MAX_GROUPS)
+        em_fatal("Config: At most %d groups are supported.", EM_MAX_GROUPS);
+
+    // Strings can't take up more than the file itself, plus terminators.
+    // Every allocation may waste up to 15 bytes on alignment. Axis and
+    // touch state of added nodes is allocated with them.
+    jsmn_arena_size = sizeof(em_config)
+        + num_devices  * (sizeof(em_device) + sizeof(em_device_info))
+        + num_entries  * (ABS_CNT * sizeof(em_axis) + EM_MAX_MT_SLOTS * sizeof(em_mt_slot))
+        + num_entries  * 2 * 16
+        + num_mappings * sizeof(em_mapping)
+        + num_outputs  * sizeof(em_step)
+        + (num_clients + num_groups) * (sizeof(em_client) + KEY_CNT * sizeof(uint16_t))
+        + num_drops    * EM_FILTER_BYTES
+        + num_stages   * sizeof(em_stage)
+        + len + jsmn_num_tokens
+        + 16 * (jsmn_num_tokens + 8);
+    jsmn_arena = em_malloc(jsmn_arena_size);
+    jsmn_arena_used = 0;
+
+    em_config *config   = jsmn_arena_alloc(sizeof(em_config));
+    config->devices     = jsmn_arena_alloc(num_devices  * sizeof(em_device));
+    config->device_info = jsmn_arena_alloc(num_devices  * sizeof(em_device_info));
+    config->max_devices = num_devices;
+    config->mappings    = jsmn_arena_alloc(num_mappings * sizeof(em_mapping));
+    config->outputs     = jsmn_arena_alloc(num_outputs  * sizeof(em_step));
+    config->clients     = jsmn_arena_alloc((num_clients + num_groups) * sizeof(em_client));
+    config->groups      = config->clients + num_clients;
+    config->stages      = jsmn_arena_alloc(num_stages   * sizeof(em_stage));
+
     int devices_tnum = jsmn_object_key_value(tokens, 0, "devices", JSMN_ARRAY);
     if (devices_tnum < 0)
         em_fatal("Config: 'devices' section not found or not an array.");
 
-    *devices_p = NULL;
-    em_device *dev = NULL;
-    for (int dev_num = 0; (dev_num < tokens[devices_tnum].size && dev_num < EM_MAX_DEVICES); dev_num++) {
-        em_device *d = em_malloc(sizeof(em_device));
-        if (dev) dev->next = d;
-        dev = d;
-        if (!(*devices_p)) *devices_p = d;
+    for (int dev_num = 0; dev_num < num_entries; dev_num++) {
+        em_device *dev = &config->devices[config->num_devices];
+        em_device_info *info = &config->device_info[config->num_devices];
+        dev->info = info;
 
         int device_tnum = jsmn_array_index(tokens, devices_tnum, dev_num, JSMN_OBJECT);
         if (device_tnum < 0)
             em_fatal("Config: 'devices' array must contain device objects.");
 
-        dev->idx = dev_num;
+        dev->idx   = config->num_devices;
+        dev->entry = dev_num;
 
         int scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "product_id", JSMN_STRING);
         if (scalar_tnum < 0) em_fatal("Config: 'product_id' is mandatory");
-        dev->product_id = (uint16_t)strtol(jsmn_tmp_value(tokens[scalar_tnum]), NULL, 0);
+        info->product_id = jsmn_get_id(tokens[scalar_tnum]);
 
         scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "vendor_id", JSMN_STRING);
         if (scalar_tnum < 0) em_fatal("Config: 'vendor_id' is mandatory");
-        dev->vendor_id = (uint16_t)strtol(jsmn_tmp_value(tokens[scalar_tnum]), NULL, 0);
+        info->vendor_id = jsmn_get_id(tokens[scalar_tnum]);
 
         scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "name", JSMN_STRING);
-        if (scalar_tnum > 0) dev->name = jsmn_get_value(tokens[scalar_tnum]);
+        if (scalar_tnum > 0) info->name = jsmn_get_value(tokens[scalar_tnum]);
 
         scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "check_capability", JSMN_STRING);
-        if (scalar_tnum > 0) dev->check_capability = jsmn_get_value(tokens[scalar_tnum]);
+        if (scalar_tnum > 0) info->check_capability = jsmn_get_value(tokens[scalar_tnum]);
+
+        info->nodes = EM_MAX_NODES;
+        scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "nodes", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) info->nodes = jsmn_get_int(tokens[scalar_tnum]);
 
-        printf("Device #%d: %04hx:%04hx ", dev->idx, dev->vendor_id, dev->product_id);
-        if (dev->check_capability) printf("[%s] ", dev->check_capability);
-        if (dev->name) printf("%s", dev->name);
+        // Recreate the device on remote clients, see em_device.slot_type.
+        scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "mirror", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) dev->mirror = jsmn_get_bool(tokens[scalar_tnum]);
+
+        printf("Device #%d: %s:%s ", dev->idx, info->vendor_id, info->product_id);
+        if (info->check_capability) printf("[%s] ", info->check_capability);
+        if (dev->mirror) printf("(mirrored) ");
+        if (info->name) printf("%s", info->name);
         printf("\n");
+
+        // Absolute axes: defaults for the device, optionally refined per axis.
+        dev->axes = jsmn_arena_alloc(ABS_CNT * sizeof(em_axis));
+        dev->mt   = jsmn_arena_alloc(EM_MAX_MT_SLOTS * sizeof(em_mt_slot));
+        int deadband = 0, quantize = 0;
+
+        scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "abs_deadband", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) deadband = jsmn_get_int(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, device_tnum, "abs_quantize", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) quantize = jsmn_get_int(tokens[scalar_tnum]);
+
+        if (deadband < 0 || quantize < 0)
+            em_fatal("Config: 'abs_deadband' and 'abs_quantize' can't be negative.");
+        for (int a = 0; a < ABS_CNT; a++) {
+            dev->axes[a].deadband = deadband;
+            dev->axes[a].quantize = quantize;
+        }
+
+        int axes_tnum = jsmn_object_key_value(tokens, device_tnum, "axes", JSMN_ARRAY);
+        if (axes_tnum > 0)
+            for (int axis_num = 0; axis_num < tokens[axes_tnum].size; axis_num++) {
+                int axis_tnum = jsmn_array_index(tokens, axes_tnum, axis_num, JSMN_OBJECT);
+                if (axis_tnum < 0)
+                    em_fatal("Config: 'axes' array must contain axis objects.");
+
+                scalar_tnum = jsmn_object_key_value(tokens, axis_tnum, "axis", JSMN_STRING);
+                if (scalar_tnum < 0) em_fatal("Config: 'axis' is mandatory in axis objects.");
+                char *tmpval = jsmn_tmp_value(tokens[scalar_tnum]);
+                int code = libevdev_event_code_from_name(EV_ABS, tmpval);
+                if (code < 0 || code >= ABS_CNT) em_fatal("Config: unknown axis '%s'.", tmpval);
+
+                scalar_tnum = jsmn_object_key_value(tokens, axis_tnum, "deadband", JSMN_PRIMITIVE);
+                if (scalar_tnum > 0) dev->axes[code].deadband = jsmn_get_int(tokens[scalar_tnum]);
+
+                scalar_tnum = jsmn_object_key_value(tokens, axis_tnum, "quantize", JSMN_PRIMITIVE);
+                if (scalar_tnum > 0) dev->axes[code].quantize = jsmn_get_int(tokens[scalar_tnum]);
+
+                if (dev->axes[code].deadband < 0 || dev->axes[code].quantize < 0)
+                    em_fatal("Config: 'deadband' and 'quantize' can't be negative.");
+            }
+
+        int drop_tnum = jsmn_object_key_value(tokens, device_tnum, "drop_events", JSMN_ARRAY);
+        if (drop_tnum > 0) jsmn_get_filter(tokens, drop_tnum, &dev->filter);
+        config->num_devices++;
+    }
+
+    // Groups, addressed as one client with its own key. Only remote
+    // clients can be members, see the clients' "groups".
+    int groups_tnum = jsmn_object_key_value(tokens, 0, "groups", JSMN_ARRAY);
+    for (int group_num = 0; group_num < num_groups; group_num++) {
+        em_client *group = &config->groups[group_num];
+        config->num_groups++;
+
+        int group_tnum = jsmn_array_index(tokens, groups_tnum, group_num, JSMN_OBJECT);
+        if (group_tnum < 0)
+            em_fatal("Config: 'groups' array must contain group objects.");
+
+        group->idx = EM_GROUP_BASE + group_num;
+
+        int scalar_tnum = jsmn_object_key_value(tokens, group_tnum, "name", JSMN_STRING);
+        if (scalar_tnum < 0) em_fatal("Config: 'name' is mandatory in group objects.");
+        group->name = jsmn_get_value(tokens[scalar_tnum]);
+        if (jsmn_group_by_name(config, group->name) != group_num)
+            em_fatal("Config: group '%s' defined twice.", group->name);
+
+        scalar_tnum = jsmn_object_key_value(tokens, group_tnum, "key", JSMN_STRING);
+        if (scalar_tnum > 0) group->key = jsmn_get_value(tokens[scalar_tnum]);
+
+        group->keymap = jsmn_arena_alloc(KEY_CNT * sizeof(uint16_t));
+        for (int k = 0; k < KEY_CNT; k++) group->keymap[k] = k;
+
+        printf("Group #%d: %s, encryption %s\n", group_num, group->name, group->key ? "enabled" : "disabled");
     }
 
     int mappings_tnum = jsmn_object_key_value(tokens, 0, "mappings", JSMN_ARRAY);
     if (mappings_tnum < 0)
         em_fatal("Config: 'mappings' section not found or not an array.");
 
-    *mappings_p = NULL;
-    em_mapping *mapping = NULL;
-    for (int mapping_num = 0; (mapping_num < tokens[mappings_tnum].size && mapping_num < EM_MAX_MAPPINGS); mapping_num++) {
-        em_mapping *m = em_malloc(sizeof(em_mapping));
-        if (mapping) mapping->next = m;
-        mapping = m;
-        if (!(*mappings_p)) *mappings_p = m;
+    em_step *output = config->outputs;
+    for (int mapping_num = 0; mapping_num < num_mappings; mapping_num++) {
+        em_mapping *mapping = &config->mappings[mapping_num];
+        config->num_mappings++;
 
         int mapping_tnum = jsmn_array_index(tokens, mappings_tnum, mapping_num, JSMN_OBJECT);
         if (mapping_tnum < 0)
@@ -185,51 +428,223 @@ void jsmn_cfg_parse(char *fname, em_device **devices_p, em_mapping **mappings_p,
         if (scalar_tnum > 0)
             mapping->always_client = jsmn_get_int(tokens[scalar_tnum]);
 
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "always_group", JSMN_STRING);
+        if (scalar_tnum > 0) {
+            char *tmpval = jsmn_tmp_value(tokens[scalar_tnum]);
+            int group_num = jsmn_group_by_name(config, tmpval);
+            if (group_num < 0) em_fatal("Config: unknown group '%s'.", tmpval);
+            mapping->always_group = group_num + 1;
+        }
+
         scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "only_device", JSMN_PRIMITIVE);
         if (scalar_tnum > 0)
             mapping->only_device = jsmn_get_int(tokens[scalar_tnum]);
 
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "tap_ms", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0)
+            mapping->tap_ms = jsmn_get_int(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "hold_ms", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0)
+            mapping->hold_ms = jsmn_get_int(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "hold", JSMN_STRING);
+        if (scalar_tnum > 0) {
+            char *tmpval = jsmn_tmp_value(tokens[scalar_tnum]);
+            mapping->hold_code = em_event_code_from_name(tmpval);
+            if (mapping->hold_code < 0 || mapping->hold_code >= KEY_CNT)
+                em_fatal("Config: unknown key code '%s'.", tmpval);
+        }
+
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "sequence_ms", JSMN_PRIMITIVE);
+        mapping->sequence_ms = (scalar_tnum > 0) ? jsmn_get_int(tokens[scalar_tnum]) : EM_DEFAULT_SEQUENCE_MS;
+
+        int sequence_tnum = jsmn_object_key_value(tokens, mapping_tnum, "sequence", JSMN_ARRAY);
+        if (sequence_tnum > 0) {
+            if (tokens[sequence_tnum].size < 2 || tokens[sequence_tnum].size > EM_MAX_SEQUENCE)
+                em_fatal("Config: 'sequence' must have between 2 and %d keys.", EM_MAX_SEQUENCE);
+            for (int event_num = 0; event_num < tokens[sequence_tnum].size; event_num++) {
+                int event_tnum = sequence_tnum + event_num + 1;
+                if (tokens[event_tnum].type != JSMN_STRING)
+                    em_fatal("Config: event specifiers must be given as quoted strings.");
+                char *tmpval = jsmn_tmp_value(tokens[event_tnum]);
+                int code = em_event_code_from_name(tmpval);
+                if (code < 0 || code >= KEY_CNT) em_fatal("Config: unknown key code '%s'.", tmpval);
+                mapping->sequence[event_num] = code;
+            }
+        }
+
+        // Sequence mappings don't need a combo.
         int combo_tnum = jsmn_object_key_value(tokens, mapping_tnum, "combo", JSMN_ARRAY);
-        if (combo_tnum < 0) em_fatal("Config: 'combo' is mandatory.");
-        for (int event_num = 0; (event_num < tokens[combo_tnum].size && event_num < EM_MAX_COMBO); event_num++) {
-            int event_tnum = combo_tnum + event_num + 1;
-            if (tokens[event_tnum].type != JSMN_STRING)
-                em_fatal("Config: event specifiers must be given as quoted strings.");
-            char *tmpval = jsmn_tmp_value(tokens[event_tnum]);
-            int code = em_event_code_from_name(tmpval);
-            if (code < 0) em_fatal("Config: unknown key code '%s'.", tmpval);
-            mapping->combo[event_num] = code;
+        if (combo_tnum < 0 && !mapping->sequence[0]) em_fatal("Config: 'combo' is mandatory.");
+        if (combo_tnum > 0)
+            for (int event_num = 0; (event_num < tokens[combo_tnum].size && event_num < EM_MAX_COMBO); event_num++) {
+                int event_tnum = combo_tnum + event_num + 1;
+                if (tokens[event_tnum].type != JSMN_STRING)
+                    em_fatal("Config: event specifiers must be given as quoted strings.");
+                char *tmpval = jsmn_tmp_value(tokens[event_tnum]);
+                int code = em_event_code_from_name(tmpval);
+                if (code < 0) em_fatal("Config: unknown key code '%s'.", tmpval);
+                mapping->combo[event_num] = code;
+            }
+
+        if (mapping->tap_ms || mapping->hold_ms) {
+            if (!mapping->combo[0] || mapping->combo[1] || mapping->combo[0] >= KEY_CNT)
+                em_fatal("Config: 'tap_ms'/'hold_ms' mappings need a single key combo.");
+            if (!mapping->hold_ms) mapping->hold_ms = mapping->tap_ms;
+            // Holding without 'hold' acts as the key itself.
+            if (!mapping->hold_code) mapping->hold_code = mapping->combo[0];
         }
 
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "step_ms", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) mapping->step_ms = jsmn_get_int(tokens[scalar_tnum]);
+        if (mapping->step_ms < 0) em_fatal("Config: 'step_ms' can't be negative.");
+
+        scalar_tnum = jsmn_object_key_value(tokens, mapping_tnum, "repeat", JSMN_PRIMITIVE);
+        mapping->repeat = (scalar_tnum > 0) ? jsmn_get_int(tokens[scalar_tnum]) : 1;
+        if (mapping->repeat < 1 || mapping->repeat > EM_MAX_REPEAT)
+            em_fatal("Config: 'repeat' must be between 1 and %d.", EM_MAX_REPEAT);
+
+        // Output steps: "+CODE" presses, "-CODE" releases, "CODE" taps and
+        // "CODE:<ms>" taps holding the key for <ms>. "wait:<ms>" pauses.
+        mapping->output = output;
         int output_tnum = jsmn_object_key_value(tokens, mapping_tnum, "output", JSMN_ARRAY);
         if (output_tnum >= 0) {
-            for (int event_num = 0; (event_num < tokens[output_tnum].size && event_num < EM_MAX_OUTPUT_EVENTS); event_num++) {
+            for (int event_num = 0; event_num < tokens[output_tnum].size; event_num++) {
                 int event_tnum = output_tnum + event_num + 1;
                 if (tokens[event_tnum].type != JSMN_STRING)
                     em_fatal("Config: event specifiers must be gives as quoted strings.");
-                mapping->output[event_num] = em_malloc(sizeof(struct input_event));
                 char *tmpval = jsmn_tmp_value(tokens[event_tnum]);
                 if (strlen(tmpval) < 5) em_fatal("Config: Invalid event specifier.");
-                mapping->output[event_num]->value = (tmpval[0] == '-') ? 0 : 1;
-                tmpval = &tmpval[1];
-                mapping->output[event_num]->type = EV_KEY;
+
+                if (!strncmp(tmpval, "wait:", 5)) {
+                    int wait_ms = atoi(&tmpval[5]);
+                    if (wait_ms <= 0) em_fatal("Config: invalid wait '%s'.", tmpval);
+                    // Waiting first needs a step to wait after.
+                    if (!mapping->num_output) {
+                        output->type  = EV_SYN;
+                        output->code  = SYN_REPORT;
+                        output++;
+                        mapping->num_output++;
+                    }
+                    output[-1].delay_ms += wait_ms;
+                    mapping->macro = 1;
+                    continue;
+                }
+
+                int hold_ms = 0;
+                char *hold = strchr(tmpval, ':');
+                if (hold) {
+                    *hold++ = '\0';
+                    hold_ms = atoi(hold);
+                    if (hold_ms <= 0) em_fatal("Config: invalid hold time in '%s'.", tmpval);
+                    mapping->macro = 1;
+                }
+                int tap = tmpval[0] != '+' && tmpval[0] != '-';
+                if (!tap && hold) em_fatal("Config: only taps take a hold time.");
+                output->value = (tmpval[0] == '-') ? 0 : 1;
+                if (!tap) tmpval = &tmpval[1];
+                output->type = EV_KEY;
                 int code = em_event_code_from_name(tmpval);
                 if (code < 0) em_fatal("Config: unknown key code in event.");
-                mapping->output[event_num]->code = code;
+                output->code = code;
+                output->delay_ms = hold_ms;
+                output++;
+                mapping->num_output++;
+
+                // Wheel steps have no release.
+                if (tap && code < 0x400) {
+                    output->type  = EV_KEY;
+                    output->code  = code;
+                    output->value = 0;
+                    output++;
+                    mapping->num_output++;
+                }
             }
         }
+        if (mapping->step_ms || mapping->repeat > 1) mapping->macro = 1;
+    }
+
+    em_transport *transport = &config->transport;
+    transport->group = EM_MULTICAST_GROUP;
+    transport->port  = EM_MULTICAST_PORT;
+    transport->ttl   = EM_MULTICAST_TTL;
+    int transport_tnum = jsmn_object_key_value(tokens, 0, "transport", JSMN_OBJECT);
+    if (transport_tnum > 0) {
+        int scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "group", JSMN_STRING);
+        if (scalar_tnum > 0) transport->group = jsmn_get_value(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "port", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) transport->port = jsmn_get_int(tokens[scalar_tnum]);
+        // Presence needs the port above as well.
+        if (transport->port <= 0 || transport->port >= 65535)
+            em_fatal("Config: transport 'port' must be between 1 and 65534.");
+
+        scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "interface", JSMN_STRING);
+        if (scalar_tnum > 0) transport->interface = jsmn_get_value(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "ttl", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) transport->ttl = jsmn_get_int(tokens[scalar_tnum]);
+        if (transport->ttl < 0 || transport->ttl > 255)
+            em_fatal("Config: transport 'ttl' must be between 0 and 255.");
+
+        scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "loopback", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) transport->loopback = jsmn_get_bool(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "sndbuf", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) transport->sndbuf = jsmn_get_int(tokens[scalar_tnum]);
+        scalar_tnum = jsmn_object_key_value(tokens, transport_tnum, "rcvbuf", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) transport->rcvbuf = jsmn_get_int(tokens[scalar_tnum]);
+        if (transport->sndbuf < 0 || transport->rcvbuf < 0)
+            em_fatal("Config: transport buffer sizes can't be negative.");
+    }
+
+    int scalar_tnum = jsmn_object_key_value(tokens, 0, "presence_timeout_ms", JSMN_PRIMITIVE);
+    config->presence_timeout_ms = (scalar_tnum > 0) ? jsmn_get_int(tokens[scalar_tnum]) : EM_DEFAULT_PRESENCE_TIMEOUT_MS;
+    if (config->presence_timeout_ms <= 0)
+        em_fatal("Config: 'presence_timeout_ms' must be positive.");
+
+    scalar_tnum = jsmn_object_key_value(tokens, 0, "presence_fallback", JSMN_PRIMITIVE);
+    if (scalar_tnum > 0) config->presence_fallback = jsmn_get_bool(tokens[scalar_tnum]);
+
+    scalar_tnum = jsmn_object_key_value(tokens, 0, "local_passthrough", JSMN_PRIMITIVE);
+    if (scalar_tnum > 0) config->local_passthrough = jsmn_get_bool(tokens[scalar_tnum]);
+
+    scalar_tnum = jsmn_object_key_value(tokens, 0, "trace_file", JSMN_STRING);
+    if (scalar_tnum > 0) config->trace_file = jsmn_get_value(tokens[scalar_tnum]);
+
+    // Plugin stages, "stages": [ { "plugin": "<path>", "name": ..., "args": ... } ].
+    // They are loaded by em_stages_open(), args goes to them as JSON text.
+    int stages_tnum = jsmn_object_key_value(tokens, 0, "stages", JSMN_ARRAY);
+    for (int stage_num = 0; stage_num < num_stages; stage_num++) {
+        em_stage *stage = &config->stages[stage_num];
+        config->num_stages++;
+
+        int stage_tnum = jsmn_array_index(tokens, stages_tnum, stage_num, JSMN_OBJECT);
+        if (stage_tnum < 0)
+            em_fatal("Config: 'stages' array must contain stage objects.");
+
+        scalar_tnum = jsmn_object_key_value(tokens, stage_tnum, "plugin", JSMN_STRING);
+        if (scalar_tnum < 0) em_fatal("Config: 'plugin' is mandatory in stage objects.");
+        stage->plugin = jsmn_get_value(tokens[scalar_tnum]);
+
+        scalar_tnum = jsmn_object_key_value(tokens, stage_tnum, "name", JSMN_STRING);
+        if (scalar_tnum > 0) stage->name = jsmn_get_value(tokens[scalar_tnum]);
+
+        stage->args = "";
+        jsmntype_t args_types[] = { JSMN_OBJECT, JSMN_ARRAY, JSMN_STRING, JSMN_PRIMITIVE };
+        for (int a = 0; a < 4; a++) {
+            scalar_tnum = jsmn_object_key_value(tokens, stage_tnum, "args", args_types[a]);
+            if (scalar_tnum > 0) stage->args = jsmn_get_value(tokens[scalar_tnum]);
+        }
     }
 
-    *clients_p = NULL;
     int clients_tnum = jsmn_object_key_value(tokens, 0, "clients", JSMN_ARRAY);
-    if (clients_tnum < 0) return;
+    if (clients_tnum < 0) goto DONE;
 
-    em_client *client = NULL;
-    for (int client_num = 0; (client_num < tokens[clients_tnum].size && client_num < EM_MAX_MAPPINGS); client_num++) {
-        em_client *m = em_malloc(sizeof(em_client));
-        if (client) client->next = m;
-        client = m;
-        if (!(*clients_p)) *clients_p = m;
+    for (int client_num = 0; client_num < num_clients; client_num++) {
+        em_client *client = &config->clients[client_num];
+        config->num_clients++;
 
         int client_tnum = jsmn_array_index(tokens, clients_tnum, client_num, JSMN_OBJECT);
         if (client_tnum < 0)
@@ -237,12 +652,69 @@ void jsmn_cfg_parse(char *fname, em_device **devices_p, em_mapping **mappings_p,
 
         client->idx = client_num;
 
-        int scalar_tnum = jsmn_object_key_value(tokens, client_tnum, "local", JSMN_PRIMITIVE);
+        scalar_tnum = jsmn_object_key_value(tokens, client_tnum, "local", JSMN_PRIMITIVE);
         if (scalar_tnum > 0) client->local = jsmn_get_bool(tokens[scalar_tnum]);
 
         scalar_tnum = jsmn_object_key_value(tokens, client_tnum, "key", JSMN_STRING);
         if (scalar_tnum > 0) client->key = jsmn_get_value(tokens[scalar_tnum]);
 
+        scalar_tnum = jsmn_object_key_value(tokens, client_tnum, "shm", JSMN_STRING);
+        if (scalar_tnum > 0) client->shm_path = jsmn_get_value(tokens[scalar_tnum]);
+        if (client->shm_path && client->local)
+            em_fatal("Config: 'shm' can't be used on the local client.");
+
+        int groups_tnum = jsmn_object_key_value(tokens, client_tnum, "groups", JSMN_ARRAY);
+        if (groups_tnum > 0) {
+            if (client->local) em_fatal("Config: 'groups' can't be used on the local client.");
+            for (int g = 0; g < tokens[groups_tnum].size; g++) {
+                int group_tnum = groups_tnum + g + 1;
+                if (tokens[group_tnum].type != JSMN_STRING)
+                    em_fatal("Config: group names must be given as quoted strings.");
+                char *tmpval = jsmn_tmp_value(tokens[group_tnum]);
+                int group_num = jsmn_group_by_name(config, tmpval);
+                if (group_num < 0) em_fatal("Config: unknown group '%s'.", tmpval);
+                client->groups |= 1u << group_num;
+            }
+        }
+
+        scalar_tnum = jsmn_object_key_value(tokens, client_tnum, "presence", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) client->presence = jsmn_get_bool(tokens[scalar_tnum]);
+        if (client->presence && client->local)
+            em_fatal("Config: 'presence' can't be used on the local client.");
+        if (client->presence && client->shm_path)
+            em_fatal("Config: 'presence' can't be used with 'shm'.");
+
+        // Key translation, "keymap": { "KEY_LEFTMETA": "KEY_LEFTCTRL", ... }.
+        // Entries don't chain, swapping two keys takes both directions.
+        client->keymap = jsmn_arena_alloc(KEY_CNT * sizeof(uint16_t));
+        for (int k = 0; k < KEY_CNT; k++) client->keymap[k] = k;
+        int keymap_tnum = jsmn_object_key_value(tokens, client_tnum, "keymap", JSMN_OBJECT);
+        if (keymap_tnum > 0) {
+            int t = keymap_tnum + 1;
+            for (int entry = 0; entry < tokens[keymap_tnum].size; entry++) {
+                if (tokens[t + 1].type != JSMN_STRING)
+                    em_fatal("Config: 'keymap' entries must map key names to key names.");
+                char *tmpval = jsmn_tmp_value(tokens[t]);
+                int from = em_event_code_from_name(tmpval);
+                if (from < 0 || from >= KEY_CNT) em_fatal("Config: unknown key code '%s'.", tmpval);
+                tmpval = jsmn_tmp_value(tokens[t + 1]);
+                int to = em_event_code_from_name(tmpval);
+                if (to < 0 || to >= KEY_CNT) em_fatal("Config: unknown key code '%s'.", tmpval);
+                client->keymap[from] = to;
+                t = jsmn_skip(tokens, t + 1);
+                if (t < 0) em_fatal("Config: Unable to parse 'keymap'.");
+            }
+        }
+
+        // Checked after the keymap, so this is about what arrives.
+        int drop_tnum = jsmn_object_key_value(tokens, client_tnum, "drop_events", JSMN_ARRAY);
+        if (drop_tnum > 0) jsmn_get_filter(tokens, drop_tnum, &client->filter);
+
+        scalar_tnum = jsmn_object_key_value(tokens, client_tnum, "redundancy", JSMN_PRIMITIVE);
+        if (scalar_tnum > 0) client->redundancy = jsmn_get_int(tokens[scalar_tnum]);
+        if (client->redundancy < 0 || client->redundancy > EM_MAX_REDUNDANCY)
+            em_fatal("Config: 'redundancy' must be between 0 and %d.", EM_MAX_REDUNDANCY);
+
         int combo_tnum = jsmn_object_key_value(tokens, client_tnum, "combo", JSMN_ARRAY);
         if (combo_tnum > 0)
             for (int event_num = 0; (event_num < tokens[combo_tnum].size && event_num < EM_MAX_COMBO); event_num++) {
@@ -256,4 +728,20 @@ void jsmn_cfg_parse(char *fname, em_device **devices_p, em_mapping **mappings_p,
             }
     }
 
+    DONE:
+    // The arena belongs to the config now.
+    jsmn_arena = NULL;
+    jsmn_cfg_abort();
+    return config;
+}
+
+// The config is the first thing in its arena, freeing it frees everything
+// but the state of nodes added by em_add_node().
+void em_config_free(em_config *config) {
+    for (int d = 0; d < config->num_devices; d++) {
+        if (!config->devices[d].node) continue;
+        free(config->devices[d].axes);
+        free(config->devices[d].mt);
+    }
+    free(config);
 }
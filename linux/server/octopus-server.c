@@ -3,17 +3,22 @@
 #include <bsd/stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <poll.h>
 #include <time.h>
+#include <signal.h>
+#include <setjmp.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <xxtea.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
@@ -25,14 +30,22 @@ void em_usage() {
     exit(-1);
 }
 
+// Set while reloading the configuration. em_fatal() then jumps back to the
+// reload instead of exiting, a broken config must not kill a running server.
+jmp_buf *em_fatal_jmp = NULL;
+
 void em_fatal(const char* format, ...) {
     va_list arglist;
 
-    printf("Fatal: ");
+    printf(em_fatal_jmp ? "Error: " : "Fatal: ");
     va_start(arglist, format);
     vprintf(format, arglist);
     va_end(arglist);
     printf("\n");
+    if (em_fatal_jmp) longjmp(*em_fatal_jmp, 1);
+
+    em_trace(EM_TRACE_MARK, -1, -1, 0, EM_TRACE_MARK_FATAL, 0, 0);
+    if (em_trace_dump() == 0) printf("Trace written to %s\n", em_trace_file());
     exit(-1);
 }
 
@@ -52,6 +65,17 @@ int em_event_code_from_name(const char *name) {
     return libevdev_event_code_from_name(EV_KEY, name);
 }
 
+// Event type of a code name, from its prefix: "MSC_SCAN" is EV_MSC,
+// BTN_* codes are keys. -1 if there is no such type.
+int em_event_type_from_code_name(const char *name) {
+    char type_name[16];
+    const char *sep = strchr(name, '_');
+    if (!sep || sep == name || sep - name > 8) return -1;
+    if (strncmp(name, "BTN_", 4) == 0) return EV_KEY;
+    snprintf(type_name, sizeof(type_name), "EV_%.*s", (int)(sep - name), name);
+    return libevdev_event_type_from_name(type_name);
+}
+
 const char * em_event_code_get_name(unsigned int code) {
     if (code == 0x400) return "WHEEL_UP";
     if (code == 0x401) return "WHEEL_RIGHT";
@@ -60,26 +84,435 @@ const char * em_event_code_get_name(unsigned int code) {
     return libevdev_event_code_get_name(EV_KEY, code);
 }
 
-em_client *em_client_by_idx(em_client *item, int idx) {
-    while (item) {
-        if (item->idx == idx) return item;
-        item = item->next;
+em_config *em_load_config(char *fname) {
+    em_config *config = jsmn_cfg_parse(fname); // Will quit on errors.
+    const char *error = NULL;
+    if (!config->num_devices)  error = "No input devices specified in configuration.";
+    if (!config->num_mappings) error = "No mappings specified in configuration.";
+    if (!config->num_clients)  error = "No clients specified in configuration.";
+    if (error) {
+        em_config_free(config);
+        em_fatal("%s", error);
+    }
+    return config;
+}
+
+volatile sig_atomic_t em_reload_requested = 0;
+void em_sighup(int sig) {
+    em_reload_requested = 1;
+}
+
+volatile sig_atomic_t em_status_requested = 0;
+void em_sigusr1(int sig) {
+    em_status_requested = 1;
+}
+
+volatile sig_atomic_t em_trace_requested = 0;
+void em_sigusr2(int sig) {
+    em_trace_requested = 1;
+}
+
+int em_device_same(em_device *a, em_device *b) {
+    if (strcmp(a->info->vendor_id, b->info->vendor_id) != 0) return 0;
+    if (strcmp(a->info->product_id, b->info->product_id) != 0) return 0;
+    if ((a->info->name == NULL) != (b->info->name == NULL)) return 0;
+    if (a->info->name && strcmp(a->info->name, b->info->name) != 0) return 0;
+    if ((a->info->check_capability == NULL) != (b->info->check_capability == NULL)) return 0;
+    if (a->info->check_capability && strcmp(a->info->check_capability, b->info->check_capability) != 0) return 0;
+    // Mirroring is set up on grabbing.
+    if (a->mirror != b->mirror) return 0;
+    return 1;
+}
+
+em_client *em_client_by_idx(em_config *config, int idx) {
+    if (idx < 0 || idx >= config->num_clients) return NULL;
+    return &config->clients[idx];
+}
+
+em_client *em_local_client(em_config *config) {
+    for (int c = 0; c < config->num_clients; c++) {
+        if (config->clients[c].local) return &config->clients[c];
     }
     return NULL;
 }
 
-void em_grab_devices(em_device *devices) {
+int em_config_uses_presence(em_config *config) {
+    for (int c = 0; c < config->num_clients; c++) {
+        if (config->clients[c].presence) return 1;
+    }
+    return 0;
+}
+
+// Interface for IPv4 multicast, by name or address. Zeroed to route.
+void em_transport_mreqn(em_transport *transport, struct ip_mreqn *mreqn) {
+    memset(mreqn, 0, sizeof(*mreqn));
+    if (!transport->interface) return;
+    if (inet_pton(AF_INET, transport->interface, &mreqn->imr_address) == 1) return;
+    mreqn->imr_ifindex = if_nametoindex(transport->interface);
+    if (!mreqn->imr_ifindex) em_fatal("Unknown interface %s.", transport->interface);
+}
+
+// Interface index for IPv6 multicast, 0 to route.
+unsigned int em_transport_ifindex(em_transport *transport) {
+    if (!transport->interface) return 0;
+    unsigned int ifindex = if_nametoindex(transport->interface);
+    if (!ifindex) em_fatal("Unknown interface %s, IPv6 needs an interface name.", transport->interface);
+    return ifindex;
+}
+
+// Multicast group address on 'port'.
+socklen_t em_transport_addr(em_transport *transport, int port, struct sockaddr_storage *addr) {
+    struct sockaddr_in  *addr4 = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+    memset(addr, 0, sizeof(*addr));
+
+    if (inet_pton(AF_INET, transport->group, &addr4->sin_addr) == 1) {
+        if (!IN_MULTICAST(ntohl(addr4->sin_addr.s_addr)))
+            em_fatal("%s is not a multicast group.", transport->group);
+        addr4->sin_family = AF_INET;
+        addr4->sin_port   = htons(port);
+        return sizeof(*addr4);
+    }
+    if (inet_pton(AF_INET6, transport->group, &addr6->sin6_addr) == 1) {
+        if (!IN6_IS_ADDR_MULTICAST(&addr6->sin6_addr))
+            em_fatal("%s is not a multicast group.", transport->group);
+        addr6->sin6_family   = AF_INET6;
+        addr6->sin6_port     = htons(port);
+        // Link-local groups (ff02::) need to know the link.
+        addr6->sin6_scope_id = em_transport_ifindex(transport);
+        return sizeof(*addr6);
+    }
+    em_fatal("Invalid multicast group %s.", transport->group);
+    return 0;
+}
+
+// Socket sending events to the group.
+int em_transport_socket(em_transport *transport, struct sockaddr_storage *addr, socklen_t *addrlen) {
+    *addrlen = em_transport_addr(transport, transport->port, addr);
+    int sock = socket(addr->ss_family, SOCK_DGRAM, 0);
+    if (sock < 0) em_fatal("Unable to open socket.");
+
+    int ttl = transport->ttl;
+    int loop = transport->loopback;
+    if (addr->ss_family == AF_INET) {
+        struct ip_mreqn mreqn;
+        em_transport_mreqn(transport, &mreqn);
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+            setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+            (transport->interface && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof(mreqn)) < 0))
+            em_fatal("Unable to set up multicast, errno %d.", errno);
+    }
+    else {
+        unsigned int ifindex = em_transport_ifindex(transport);
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) < 0 ||
+            setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+            (ifindex && setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0))
+            em_fatal("Unable to set up multicast, errno %d.", errno);
+    }
+    if (transport->sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &transport->sndbuf, sizeof(transport->sndbuf)) < 0)
+        em_fatal("Unable to set socket send buffer size.");
+
+    // Never block on a busy link, packets are queued per client instead.
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return sock;
+}
+
+int em_transport_changed(em_transport *a, em_transport *b) {
+    int differs(const char *x, const char *y) {
+        if (!x || !y) return x != y;
+        return strcmp(x, y) != 0;
+    }
+    return differs(a->group, b->group) || differs(a->interface, b->interface) ||
+        a->port != b->port || a->ttl != b->ttl || a->loopback != b->loopback ||
+        a->sndbuf != b->sndbuf || a->rcvbuf != b->rcvbuf;
+}
+
+// Clients announce themselves to the multicast group on the port above
+// the event port.
+int em_presence_socket(em_transport *transport) {
+    struct sockaddr_storage group;
+    em_transport_addr(transport, transport->port + 1, &group);
+
+    int psock = socket(group.ss_family, SOCK_DGRAM, 0);
+    if (psock < 0) em_fatal("Unable to open presence socket.");
+
+    int one = 1;
+    setsockopt(psock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (transport->rcvbuf && setsockopt(psock, SOL_SOCKET, SO_RCVBUF, &transport->rcvbuf, sizeof(transport->rcvbuf)) < 0)
+        em_fatal("Unable to set socket receive buffer size.");
+
+    if (group.ss_family == AF_INET) {
+        struct sockaddr_in paddr;
+        memset(&paddr, 0, sizeof(paddr));
+        paddr.sin_family = AF_INET;
+        paddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        paddr.sin_port = htons(transport->port + 1);
+        if (bind(psock, (struct sockaddr *)&paddr, sizeof(paddr)) < 0)
+            em_fatal("Unable to bind presence socket to port %d.", transport->port + 1);
+
+        struct ip_mreqn mreqn;
+        em_transport_mreqn(transport, &mreqn);
+        mreqn.imr_multiaddr = ((struct sockaddr_in *)&group)->sin_addr;
+        if (setsockopt(psock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreqn, sizeof(mreqn)) < 0)
+            em_fatal("Unable to join multicast group for presence.");
+    }
+    else {
+        struct sockaddr_in6 paddr;
+        memset(&paddr, 0, sizeof(paddr));
+        paddr.sin6_family = AF_INET6;
+        paddr.sin6_addr = in6addr_any;
+        paddr.sin6_port = htons(transport->port + 1);
+        if (bind(psock, (struct sockaddr *)&paddr, sizeof(paddr)) < 0)
+            em_fatal("Unable to bind presence socket to port %d.", transport->port + 1);
+
+        struct ipv6_mreq mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *)&group)->sin6_addr;
+        mreq.ipv6mr_interface = em_transport_ifindex(transport);
+        if (setsockopt(psock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0)
+            em_fatal("Unable to join multicast group for presence.");
+    }
+
+    fcntl(psock, F_SETFL, fcntl(psock, F_GETFL) | O_NONBLOCK);
+    return psock;
+}
+
+// Called when a device has been grabbed.
+void em_device_setup(em_device *dev) {
+    dev->slot_type = 0;
+    if (dev->mirror) {
+        if (!libevdev_has_event_type(dev->evdev, EV_ABS))
+            printf("Device #%d: No absolute axes, not mirroring\n", dev->idx);
+        else if (dev->idx >= EM_MAX_SLOTS)
+            printf("Device #%d: Only devices #0 to #%d can be mirrored\n", dev->idx, EM_MAX_SLOTS - 1);
+        else dev->slot_type = EM_SLOT_TYPE(dev->idx, 0);
+    }
+    dev->frame_events = 0;
+    for (int a = 0; a < ABS_CNT; a++) dev->axes[a].has_last = 0;
+
+    dev->mt_slots = 0;
+    if (dev->slot_type && libevdev_get_num_slots(dev->evdev) > 0) {
+        dev->mt_slots = libevdev_get_num_slots(dev->evdev);
+        if (dev->mt_slots > EM_MAX_MT_SLOTS) {
+            printf("Device #%d: Only forwarding %d of %d touch slots\n", dev->idx, EM_MAX_MT_SLOTS, dev->mt_slots);
+            dev->mt_slots = EM_MAX_MT_SLOTS;
+        }
+        dev->mt_slot = libevdev_get_current_slot(dev->evdev);
+        for (int s = 0; s < dev->mt_slots; s++) {
+            for (int a = 0; a < EM_MT_AXES; a++)
+                dev->mt[s].value[a] = libevdev_get_slot_value(dev->evdev, s, EM_MT_FIRST + a);
+            dev->mt[s].changed = 0;
+        }
+    }
+}
+
+// Installs the device filter as the kernel's event mask on our fd, so
+// dropped events aren't even queued for us. With reset, masks left from
+// an earlier filter are cleared too. Older kernels lack EVIOCSMASK, the
+// main loop checks the filter again anyway.
+void em_device_mask(em_device *dev, int reset) {
+#ifdef EVIOCSMASK
+    // Types that have a code mask in evdev.
+    static const uint16_t masked_types[] = { EV_KEY, EV_REL, EV_ABS, EV_MSC, EV_SW, EV_LED, EV_SND, EV_FF };
+    em_filter *filter = &dev->filter;
+    uint8_t bits[EM_FILTER_BYTES];
+    struct input_mask mask;
+
+    int used = filter->types != 0;
+    for (int t = 0; t < EV_CNT && !used; t++) used = filter->codes[t] != NULL;
+    if (!used && !reset) return;
+
+    memset(bits, 0xff, sizeof(bits));
+    for (int t = 0; t < EV_CNT; t++) {
+        if (filter->types & (1u << t)) bits[t >> 3] &= ~(1 << (t & 7));
+    }
+    mask.type       = 0;
+    mask.codes_size = sizeof(bits);     // Bytes, the kernel clamps it per type
+    mask.codes_ptr  = (uint64_t)(uintptr_t)bits;
+    if (ioctl(dev->evfd, EVIOCSMASK, &mask) < 0) {
+        if (used) printf("Device #%d: No kernel event masks, errno %d, filtering in the server\n", dev->idx, errno);
+        return;
+    }
+
+    for (size_t m = 0; m < sizeof(masked_types) / sizeof(masked_types[0]); m++) {
+        uint16_t type = masked_types[m];
+        memset(bits, 0xff, sizeof(bits));
+        if (filter->codes[type]) {
+            for (int i = 0; i < EM_FILTER_BYTES; i++) bits[i] = ~filter->codes[type][i];
+        }
+        else if (!reset) continue;
+        mask.type       = type;
+        if (ioctl(dev->evfd, EVIOCSMASK, &mask) < 0)
+            printf("Device #%d: Unable to mask %s events, errno %d\n", dev->idx, libevdev_event_type_get_name(type), errno);
+    }
+#endif
+}
+
+// Deadband and quantization for absolute axes. Returns 0 if the value
+// didn't change and the event can be dropped.
+int em_axis_filter(em_device *dev, struct input_event *ie) {
+    // Multitouch axes repeat per slot, leave them alone.
+    if (ie->code >= ABS_MT_SLOT || ie->code >= ABS_CNT) return 1;
+
+    em_axis *axis = &dev->axes[ie->code];
+    const struct input_absinfo *absinfo = libevdev_get_abs_info(dev->evdev, ie->code);
+    int value = ie->value;
+
+    if (absinfo && (axis->deadband || axis->quantize)) {
+        int center = absinfo->minimum + (absinfo->maximum - absinfo->minimum) / 2;
+        int delta = value - center;
+        if (axis->deadband && delta <= axis->deadband && delta >= -axis->deadband) {
+            value = center;
+        }
+        else if (axis->quantize) {
+            int q = axis->quantize;
+            delta = (delta >= 0 ? delta + q / 2 : delta - q / 2) / q * q;
+            value = center + delta;
+            if (value < absinfo->minimum) value = absinfo->minimum;
+            if (value > absinfo->maximum) value = absinfo->maximum;
+        }
+    }
+
+    if (axis->has_last && axis->last == value) return 0;
+    axis->has_last = 1;
+    axis->last = value;
+    ie->value = value;
+    return 1;
+}
+
+// Track multitouch events in the slot state.
+void em_mt_update(em_device *dev, struct input_event *ie) {
+    if (ie->code == ABS_MT_SLOT) {
+        dev->mt_slot = ie->value;
+        return;
+    }
+    if (dev->mt_slot < 0 || dev->mt_slot >= dev->mt_slots) return;
+
+    em_mt_slot *slot = &dev->mt[dev->mt_slot];
+    int a = ie->code - EM_MT_FIRST;
+    if (slot->value[a] == ie->value) return;
+    slot->value[a] = ie->value;
+    slot->changed |= 1 << a;
+}
+
+// Mark all touching slots as changed, for a client that lacks them.
+void em_mt_refresh(em_device *dev) {
+    for (int s = 0; s < dev->mt_slots; s++) {
+        if (dev->mt[s].value[ABS_MT_TRACKING_ID - EM_MT_FIRST] >= 0)
+            dev->mt[s].changed = (1 << EM_MT_AXES) - 1;
+    }
+}
+
+// Take or give up exclusive access to a device. Keys still held when
+// grabbing are released towards the desktop first, it would never see
+// them go up otherwise. Those releases come back on our own fd, they are
+// marked in dev->injected for the drop stage.
+void em_device_grab(em_device *dev, int grab) {
+    if (dev->grabbed == grab) return;
+    memset(dev->injected, 0, sizeof(dev->injected));
+
+    if (grab) {
+        struct input_event ev[KEY_CNT + 1];
+        int num = 0;
+        memset(ev, 0, sizeof(ev));
+        for (int k = 0; k < KEY_CNT; k++) {
+            if (!libevdev_get_event_value(dev->evdev, EV_KEY, k)) continue;
+            ev[num].type = EV_KEY;
+            ev[num].code = k;
+            num++;
+        }
+        if (num) {
+            ev[num].type = EV_SYN;
+            ev[num].code = SYN_REPORT;
+            num++;
+            if (write(dev->evfd, ev, num * sizeof(ev[0])) < 0)
+                printf("Device #%d: Unable to release keys for the desktop, errno %d\n", dev->idx, errno);
+            else for (int e = 0; e < num - 1; e++)
+                dev->injected[ev[e].code >> 3] |= 1 << (ev[e].code & 7);
+        }
+    }
+
+    if (libevdev_grab(dev->evdev, grab ? LIBEVDEV_GRAB : LIBEVDEV_UNGRAB) < 0) {
+        printf("Device #%d: Unable to %s device\n", dev->idx, grab ? "grab" : "ungrab");
+        return;
+    }
+    dev->grabbed = grab;
+}
+
+// Close the event node and hand the uinput clone back to the pool.
+void em_release_device(em_device *dev) {
+    if (dev->clone) {
+        em_clone_release(dev->clone, dev->evdev);
+        dev->clone = NULL;
+        dev->uidev = NULL;
+    }
+    if (dev->evdev) {
+        libevdev_free(dev->evdev);
+        dev->evdev = NULL;
+    }
+    if (dev->evfd) {
+        close(dev->evfd);
+        dev->evfd = 0;
+    }
+}
+
+// Add a device for another event node of the entry first belongs to,
+// numbered after all entries. NULL if the entry has all its "nodes" or
+// the device table is full.
+em_device *em_add_node(em_config *config, em_device *first) {
+    em_device *last = first;
+    int nodes = 1;
+    while (last->next_node) {
+        last = last->next_node;
+        nodes++;
+    }
+    if (nodes >= first->info->nodes || config->num_devices == config->max_devices) return NULL;
+
+    em_device *dev = &config->devices[config->num_devices];
+    dev->idx    = config->num_devices;
+    dev->entry  = first->entry;
+    dev->node   = nodes;
+    dev->filter = first->filter;
+    dev->mirror = first->mirror;
+    dev->info   = &config->device_info[config->num_devices];
+    *dev->info  = *first->info;
+    dev->info->device[0] = '\0';
+    dev->axes   = em_malloc(ABS_CNT * sizeof(em_axis));
+    dev->mt     = em_malloc(EM_MAX_MT_SLOTS * sizeof(em_mt_slot));
+    for (int a = 0; a < ABS_CNT; a++) {
+        dev->axes[a].deadband = first->axes[a].deadband;
+        dev->axes[a].quantize = first->axes[a].quantize;
+    }
+    last->next_node = dev;
+    config->num_devices++;
+    return dev;
+}
+
+void em_grab_devices(em_config *config) {
     struct dirent **event_dev_list;
 
-    #define EM_MAX_CMP_CHARS 4
-    int cmp_file(char *fpath, char *string) {
-        char data[EM_MAX_CMP_CHARS];
+    // Identity of one event node, read once per rescan.
+    typedef struct {
+        char   *node;
+        char    vendor[8];
+        char    product[8];
+        char    name[EM_MAX_STR+1];
+        int     has_name;
+    } em_node_id;
+
+    // First line of a sysfs attribute of the node, empty if unreadable.
+    void read_attr(char *node, char *attr, char *buf, int size) {
+        char fpath[EM_MAX_STR+1];
+        snprintf(fpath, EM_MAX_STR, EM_INPUT_DEV_DIR"/%s/device/%s", node, attr);
+        buf[0] = '\0';
         int fd = open(fpath, O_RDONLY);
-        if (!fd) return 0;
-        int i = read(fd, data, EM_MAX_CMP_CHARS);
+        if (fd < 0) return;
+        int rc = read(fd, buf, size - 1);
         close(fd);
-        if (i < strlen(string)) return 0;
-        return strncmp(string, data, strlen(string)) == 0 ? 1 : 0;
+        if (rc < 0) rc = 0;
+        buf[rc] = '\0';
+        char *lf = strchr(buf, '\n');
+        if (lf) *lf = '\0';
     }
 
     int prefix_filter(const struct dirent *entry) {
@@ -94,127 +527,247 @@ void em_grab_devices(em_device *devices) {
         return;
     }
 
-    em_device* dev = devices;
-    while (dev) {
-        char fpath[EM_MAX_STR+1];
-        char cmpstr[EM_MAX_STR+1];
-
-        if (dev->active) goto NEXT_DEV;
-
-        if (dev->device) {
-            free(dev->device);
-            dev->device = NULL;
-        }
-
-        int found = 0;
-        for (int i = 0; i < num_entries; i++) {
-            snprintf(fpath, EM_MAX_STR, EM_INPUT_DEV_DIR"/%s/device/id/product", event_dev_list[i]->d_name);
-            snprintf(cmpstr, EM_MAX_STR, "%04hx", dev->product_id);
-            if (cmp_file(fpath, cmpstr)) {
-                snprintf(fpath, EM_MAX_STR, EM_INPUT_DEV_DIR"/%s/device/id/vendor", event_dev_list[i]->d_name);
-                snprintf(cmpstr, EM_MAX_STR, "%04hx", dev->vendor_id);
-                if (cmp_file(fpath, cmpstr)) {
-                    int ok = 1;
-
-                    if (dev->name) {
-                        snprintf(fpath, EM_MAX_STR, EM_INPUT_DEV_DIR"/%s/device/name", event_dev_list[i]->d_name);
-                        int fd = open(fpath, O_RDONLY);
-                        if (fd >= 0) {
-                            int rc = read(fd, cmpstr, EM_MAX_STR);
-                            if (rc > 0) {
-                                cmpstr[rc] = '\0';
-                                char *lf = strchr(cmpstr, '\n');
-                                if (lf) *lf = '\0';
-                                if (strcmp(cmpstr, dev->name) != 0) ok = 0;
-                            }
-                            else ok = 0;
-
-                            close(fd);
-                        }
-                        else ok = 0;
-                    }
+    // Grabbed devices without a pooled clone, created in one go below.
+    // Nodes found on the way may add devices.
+    em_device       **pending        = em_malloc(config->max_devices * sizeof(em_device *));
+    struct libevdev **pending_evdevs = em_malloc(config->max_devices * sizeof(struct libevdev *));
+    char            **pending_names  = em_malloc(config->max_devices * sizeof(char *));
+    int               num_pending    = 0;
+
+    // Config entries by their first device. Entries with plain IDs are
+    // sorted by vendor:product and found by binary search, the ones with
+    // wildcards are tried on every node.
+    typedef struct {
+        uint32_t    key;
+        em_device  *first;
+    } em_index;
+    em_index   *exact     = em_malloc(config->num_devices * sizeof(em_index));
+    em_device **wild      = em_malloc(config->num_devices * sizeof(em_device *));
+    int         num_exact = 0;
+    int         num_wild  = 0;
+
+    uint32_t id_key(char *vendor, char *product) {
+        return (uint32_t)strtoul(vendor, NULL, 16) << 16 | (uint32_t)strtoul(product, NULL, 16);
+    }
 
-                    if (dev->check_capability) {
-                        snprintf(fpath, EM_MAX_STR, EM_INPUT_DEV_DIR"/%s/device/capabilities/%s", event_dev_list[i]->d_name, dev->check_capability);
-                        if (cmp_file(fpath, "0")) ok = 0;
-                    }
+    int index_cmp(const void *a, const void *b) {
+        const em_index *ia = a, *ib = b;
+        if (ia->key != ib->key) return ia->key < ib->key ? -1 : 1;
+        return ia->first->entry - ib->first->entry;
+    }
 
-                    if (ok) {
-                        if (found) {
-                            if (dev->device) printf("Device #%d: Found more than one device, only using %s\n", dev->idx, dev->device);
-                        }
-                        else {
-                            if (dev->device) free(dev->device);
-                            found = 1;
-                            dev->device = strdup(event_dev_list[i]->d_name);
-                            if (!dev->device) em_fatal("strdup() failed");
-                        }
-                    }
-                }
+    em_device *dev;
+    for (int d = 0; d < config->num_devices; d++) {
+        dev = &config->devices[d];
+        em_device_info *info = dev->info;
+
+        if (dev->node == 0) {
+            if (strpbrk(info->vendor_id, "*?[") || strpbrk(info->product_id, "*?[")) {
+                wild[num_wild++] = dev;
+            }
+            else {
+                exact[num_exact].key   = id_key(info->vendor_id, info->product_id);
+                exact[num_exact].first = dev;
+                num_exact++;
             }
         }
 
-        if (found) {
-            snprintf(fpath, EM_MAX_STR, "/dev/input/%s", dev->device);
-            dev->evfd = open(fpath, O_RDONLY|O_NONBLOCK);
-            if (dev->evfd < 0 || libevdev_new_from_fd(dev->evfd, &(dev->evdev)) < 0) {
-                printf("Device #%d: Unable to open %s\n", dev->idx, fpath);
-                goto DEACTIVATE_DEV;
-            }
+        if (dev->active) continue;
 
-            if (libevdev_grab(dev->evdev, LIBEVDEV_GRAB) < 0) {
-                printf("Device #%d: Unable to grab device %s\n", dev->idx, fpath);
-                goto DEACTIVATE_DEV;
-            }
+        // Leftovers from a device that went away. Releasing the clone
+        // first lets the device pick it up again if it has reappeared.
+        em_release_device(dev);
+        info->device[0] = '\0';
+    }
+    qsort(exact, num_exact, sizeof(em_index), index_cmp);
 
-            char *name = strdup(libevdev_get_name(dev->evdev));
-            if (!name) em_fatal("strdup() failed");
-            snprintf(fpath, EM_MAX_STR, "%s [octopus]", name);
-            libevdev_set_name(dev->evdev, fpath);
-            free(name);
+    // Device of the entry starting at first that has no node yet.
+    em_device *free_node(em_device *first) {
+        for (em_device *dev = first; dev; dev = dev->next_node) {
+            if (!dev->active && !dev->info->device[0]) return dev;
+        }
+        return NULL;
+    }
 
-            dev->uifd = open("/dev/uinput", O_RDWR);
-            if (dev->uifd < 0 || libevdev_uinput_create_from_device(dev->evdev, dev->uifd, &(dev->uidev)) != 0) {
-                printf("Device #%d: Unable to open uinput device\n", dev->idx);
-                goto DEACTIVATE_DEV;
-            }
+    // Whether the entry starting at first may get a device for another node.
+    int node_room(em_device *first) {
+        int nodes = 1;
+        for (em_device *dev = first->next_node; dev; dev = dev->next_node) nodes++;
+        return nodes < first->info->nodes && config->num_devices < config->max_devices;
+    }
 
-            dev->active = 1;
-            printf("Device #%d: Using device node %s\n", dev->idx, dev->device);
+    int node_matches(em_device *first, em_node_id *id) {
+        em_device_info *info = first->info;
+        if (fnmatch(info->vendor_id, id->vendor, 0) != 0) return 0;
+        if (fnmatch(info->product_id, id->product, 0) != 0) return 0;
 
-            goto NEXT_DEV;
+        if (info->name) {
+            if (!id->has_name) {
+                read_attr(id->node, "name", id->name, sizeof(id->name));
+                id->has_name = 1;
+            }
+            if (fnmatch(info->name, id->name, 0) != 0) return 0;
         }
 
-        DEACTIVATE_DEV:
+        if (info->check_capability) {
+            char attr[EM_MAX_STR+1];
+            char cap[EM_MAX_STR+1];
+            snprintf(attr, EM_MAX_STR, "capabilities/%s", info->check_capability);
+            read_attr(id->node, attr, cap, sizeof(cap));
+            if (strcmp(cap, "0") == 0) return 0;
+        }
+        return 1;
+    }
 
-        if (dev->evfd) {
-            close(dev->evfd);
-            dev->evfd = 0;
+    // One pass over the event nodes. Each goes to the first entry in
+    // config order that matches it and still has a device without a node.
+    for (int i = 0; i < num_entries; i++) {
+        em_node_id id;
+        id.node     = event_dev_list[i]->d_name;
+        id.has_name = 0;
+
+        int in_use = 0;
+        for (int d = 0; d < config->num_devices && !in_use; d++) {
+            dev = &config->devices[d];
+            if (dev->active && strcmp(dev->info->device, id.node) == 0) in_use = 1;
         }
-        if (dev->evdev) {
-            libevdev_free(dev->evdev);
-            dev->evdev = NULL;
+        if (in_use) continue;
+
+        read_attr(id.node, "id/vendor", id.vendor, sizeof(id.vendor));
+        read_attr(id.node, "id/product", id.product, sizeof(id.product));
+        if (!id.vendor[0] || !id.product[0]) continue;
+
+        em_device *match = NULL;    // First entry matching the node
+        em_device *take  = NULL;    // Device the node goes to, or
+        em_device *grow  = NULL;    // the entry that gets a device for it
+
+        void consider(em_device *first) {
+            if (take && first->entry > take->entry) return;
+            if (grow && first->entry > grow->entry) return;
+            if (!node_matches(first, &id)) return;
+            if (!match || first->entry < match->entry) match = first;
+            em_device *slot = free_node(first);
+            if (slot) {
+                take = slot;
+                grow = NULL;
+            }
+            else if (node_room(first)) {
+                grow = first;
+                take = NULL;
+            }
+        }
+
+        uint32_t key = id_key(id.vendor, id.product);
+        int lo = 0, hi = num_exact;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (exact[mid].key < key) lo = mid + 1;
+            else hi = mid;
         }
-        if (dev->uifd) {
-            close(dev->uifd);
-            dev->uifd = 0;
+        for (int e = lo; e < num_exact && exact[e].key == key; e++) consider(exact[e].first);
+        for (int w = 0; w < num_wild; w++) consider(wild[w]);
+
+        if (grow) take = em_add_node(config, grow);
+        if (take)
+            snprintf(take->info->device, sizeof(take->info->device), "%s", id.node);
+        else if (match && config->num_devices == config->max_devices)
+            printf("Device #%d: Not using %s, no room for more than %d devices\n", match->idx, id.node, config->max_devices);
+        else if (match)
+            printf("Device #%d: Not using %s, all %d nodes taken\n", match->idx, id.node, match->info->nodes);
+    }
+    free(exact);
+    free(wild);
+
+    for (int d = 0; d < config->num_devices; d++) {
+        dev = &config->devices[d];
+        em_device_info *info = dev->info;
+        char fpath[EM_MAX_STR+1];
+
+        if (dev->active || !info->device[0]) continue;
+
+        snprintf(fpath, EM_MAX_STR, "/dev/input/%s", info->device);
+        // Passthrough writes key releases back to the device node, and a
+        // reload may switch it on for devices that stay open.
+        dev->evfd = open(fpath, O_RDWR|O_NONBLOCK);
+        if (dev->evfd < 0) dev->evfd = open(fpath, O_RDONLY|O_NONBLOCK);
+        if (dev->evfd < 0 || libevdev_new_from_fd(dev->evfd, &(dev->evdev)) < 0) {
+            printf("Device #%d: Unable to open %s\n", dev->idx, fpath);
+            goto DEACTIVATE_DEV;
+        }
+
+        if (libevdev_grab(dev->evdev, LIBEVDEV_GRAB) < 0) {
+            printf("Device #%d: Unable to grab device %s\n", dev->idx, fpath);
+            goto DEACTIVATE_DEV;
         }
-        if (dev->uidev) {
-            libevdev_uinput_destroy(dev->uidev);
-            dev->uidev = NULL;
+        dev->grabbed = 1;
+
+        // Event timestamps on the trace clock.
+        libevdev_set_clock_id(dev->evdev, CLOCK_MONOTONIC);
+        em_device_mask(dev, 0);
+
+        // Pool lookup uses the original name, so do it before renaming.
+        dev->clone = em_clone_acquire(dev->evdev);
+
+        char *name = strdup(libevdev_get_name(dev->evdev));
+        if (!name) em_fatal("strdup() failed");
+        snprintf(fpath, EM_MAX_STR, "%s [octopus]", name);
+        libevdev_set_name(dev->evdev, fpath);
+
+        if (!dev->clone) {
+            pending[num_pending] = dev;
+            pending_evdevs[num_pending] = dev->evdev;
+            pending_names[num_pending] = name;
+            num_pending++;
+            continue;
         }
+        free(name);
+
+        dev->uidev = dev->clone->uidev;
+        dev->active = 1;
+        em_device_setup(dev);
+        printf("Device #%d: Using device node %s (reusing uinput clone)\n", dev->idx, info->device);
+
+        continue;
+
+        DEACTIVATE_DEV:
+
+        em_release_device(dev);
 
         dev->active = 0;
 
-        if (dev->device) {
+        if (info->device[0]) {
             printf("Device #%d: Device inactive\n", dev->idx);
-            free(dev->device);
-            dev->device = NULL;
+            info->device[0] = '\0';
         }
+    }
+
+    if (num_pending) {
+        em_clone **clones = em_malloc(num_pending * sizeof(em_clone *));
+        em_clone_create_all(pending_evdevs, pending_names, clones, num_pending);
 
-        NEXT_DEV:
-        dev = dev->next;
+        for (int i = 0; i < num_pending; i++) {
+            dev = pending[i];
+            free(pending_names[i]);
+
+            if (!clones[i]) {
+                printf("Device #%d: Unable to open uinput device\n", dev->idx);
+                em_release_device(dev);
+                printf("Device #%d: Device inactive\n", dev->idx);
+                dev->info->device[0] = '\0';
+                continue;
+            }
+
+            dev->clone = clones[i];
+            dev->uidev = dev->clone->uidev;
+            dev->active = 1;
+            em_device_setup(dev);
+            printf("Device #%d: Using device node %s\n", dev->idx, dev->info->device);
+        }
+        free(clones);
     }
+    free(pending);
+    free(pending_evdevs);
+    free(pending_names);
 
     for (int i = 0; i < num_entries; i++) {
         free(event_dev_list[i]);
@@ -235,14 +788,20 @@ int main(int argc, char* argv[]) {
 
     if (argc < 2) em_usage();
 
-    // Read config file passed on cmdline.
-    em_device  *devices;
-    em_mapping *mappings;
-    em_client  *clients;
-    jsmn_cfg_parse(argv[1], &devices, &mappings, &clients); // Will quit on errors.
-    if (!devices)  em_fatal("No input devices specified in configuration.");
-    if (!mappings) em_fatal("No mappings specified in configuration.");
-    if (!clients)  em_fatal("No clients specified in configuration.");
+    // Read config file passed on cmdline. Reloaded on SIGHUP.
+    em_config  *config   = em_load_config(argv[1]);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = em_sighup;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = em_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = em_sigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    em_trace_set_file(config->trace_file);
+    em_stages_open(config);
 
     // Open our output device. Enable for all KEY_* and BTN_*.
     struct libevdev_uinput *uiodev;
@@ -255,52 +814,344 @@ int main(int argc, char* argv[]) {
     if (libevdev_uinput_create_from_device(odev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uiodev) != 0)
         em_fatal("Unable to open output device.");
 
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) em_fatal("Unable to open socket.");
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(EM_MULTICAST_GROUP);
-    addr.sin_port = htons(EM_MULTICAST_PORT);
+    // Sockets stay as set up here, the config strings don't survive reloads.
+    em_transport transport = config->transport;
+    transport.group = strdup(transport.group);
+    if (transport.interface) transport.interface = strdup(transport.interface);
+    if (!transport.group || (config->transport.interface && !transport.interface)) em_fatal("strdup() failed");
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int sock = em_transport_socket(&transport, &addr, &addrlen);
+    printf("Sending events to %s port %d%s%s\n", transport.group, transport.port,
+        transport.interface ? " via " : "", transport.interface ? transport.interface : "");
+
+    // Only listen for announcements if some client wants presence tracking.
+    int psock = em_config_uses_presence(config) ? em_presence_socket(&transport) : -1;
+
+    // Shared memory rings stay as long as their path is configured, a
+    // path may be shared by several client indices.
+    em_shm *shm_find(em_config *cfg, const char *path) {
+        for (int c = 0; c < cfg->num_clients; c++) {
+            em_shm *shm = cfg->clients[c].shm;
+            if (shm && !strcmp(shm->path, path)) return shm;
+        }
+        return NULL;
+    }
+
+    void shm_setup(em_config *new_config, em_config *old_config) {
+        for (int c = 0; c < new_config->num_clients; c++) {
+            em_client *client = &new_config->clients[c];
+            if (!client->shm_path) continue;
+            client->shm = shm_find(new_config, client->shm_path);
+            if (!client->shm && old_config) client->shm = shm_find(old_config, client->shm_path);
+            if (!client->shm) {
+                client->shm = em_shm_open(client->shm_path);
+                printf("Client #%u: shared memory at %s\n", client->idx, client->shm_path);
+            }
+        }
+    }
+
+    void shm_close_unused(em_config *old_config, em_config *new_config) {
+        for (int c = 0; c < old_config->num_clients; c++) {
+            em_shm *shm = old_config->clients[c].shm;
+            if (!shm || shm_find(new_config, shm->path) == shm) continue;
+            for (int o = c + 1; o < old_config->num_clients; o++) {
+                if (old_config->clients[o].shm == shm) old_config->clients[o].shm = NULL;
+            }
+            em_shm_close(shm);
+        }
+    }
+    shm_setup(config, NULL);
 
     // Array holding currently pressed keys.
     int active_keys[EM_MAX_COMBO];
     memset(active_keys, 0, sizeof(active_keys));
 
     // Currently active client
-    em_client *active_client = clients;
+    em_client *active_client = &config->clients[0];
+
+    auto void send_remote_packet(em_client *client, uint8_t *buf, size_t len);
 
     void send_remote_event(em_client *client, uint16_t type, uint16_t code, int32_t value) {
-        struct em_packet packet;
-        memset(&packet, 0, sizeof(packet));
-        packet.clientIdx = (uint8_t)client->idx;
-        packet.enc       = 0;
-        packet.type      = type;
-        packet.code      = code;
-        packet.value     = value;
+        // Nobody listening, don't bother encrypting and sending.
+        if (client->presence && !client->present) {
+            em_trace(EM_TRACE_DROP, -1, client->idx, type, code, value, EM_TRACE_DROP_ABSENT);
+            return;
+        }
+
+        // No SYN_REPORT for frames that had all their events filtered.
+        // Mirrored devices (slot types) do this themselves, frame_events.
+        if (type == EV_SYN && code == SYN_REPORT) {
+            if (!client->frame_open) {
+                em_trace(EM_TRACE_DROP, -1, client->idx, type, code, value, EM_TRACE_DROP_EMPTY);
+                return;
+            }
+            client->frame_open = 0;
+        }
+        else if (type < EV_CNT) client->frame_open = 1;
+        em_trace(EM_TRACE_SEND, -1, client->idx, type, code, value, 0);
+
+        uint8_t buf[EM_MAX_UDP_SIZE];
+        struct em_packet *packet = (struct em_packet *)buf;
+        memset(buf, 0, sizeof(buf));
+        packet->clientIdx = (uint8_t)client->idx;
+        packet->enc       = 0;
+        packet->type      = type;
+        packet->code      = code;
+        packet->value     = value;
+        // Low 16 bits carry the send time in ms, clients use it to pace
+        // motion playout.
+        packet->rnd       = em_now_ms() & EM_STAMP_MASK;
+        size_t len = EM_ENC_CLEAR_LEN;
+
+        // Piggyback the last key transitions so a lost packet can't leave
+        // a key stuck. Motion isn't logged, the next report corrects it.
+        if (client->redundancy) {
+            struct em_ext_header *ext = (struct em_ext_header *)&buf[2 + EM_ENC_CLEAR_LEN];
+            struct em_keylog_entry *log = client->keylog;
+            int num = client->keylog_num;
+
+            ext->type = EM_EXT_KEYLOG;
+            if (type == EV_KEY && value < 2) {
+                if (!++client->key_seq) client->key_seq = 1;
+                ext->seq = client->key_seq;
+                if (num == client->redundancy) memmove(&log[0], &log[1], --num * sizeof(log[0]));
+                // The event itself isn't repeated in the log it carries.
+                memcpy(ext + 1, log, num * sizeof(log[0]));
+                ext->len = sizeof(*ext) + num * sizeof(log[0]);
+                log[num].seq   = client->key_seq;
+                log[num].code  = code;
+                log[num].value = value;
+                client->keylog_num = num + 1;
+            }
+            else {
+                memcpy(ext + 1, log, num * sizeof(log[0]));
+                ext->len = sizeof(*ext) + num * sizeof(log[0]);
+            }
+            len += ext->len;
+        }
+
+        send_remote_packet(client, buf, len);
+    }
+
+    // Encrypt and send a packet holding 'len' bytes of event and extensions.
+    // Returns 1 if the socket would block, the packet is left untouched
+    // for another try. Other errors drop the packet.
+    int transmit_packet(em_client *client, uint8_t *plain, size_t len) {
+        struct em_packet *event = (struct em_packet *)plain;
+        uint8_t buf[EM_MAX_UDP_SIZE];
+        struct em_packet *packet = (struct em_packet *)buf;
+        size_t size = len + 2;
+        memcpy(buf, plain, size);
+
         if (client->key) {
-            packet.enc = EM_ENC_ENC_LEN;
-            // Add 32 random bits to make chosen plaintext a bit harder
-            packet.rnd = arc4random();
-            size_t len;
-            char *encdata = xxtea_encrypt(&(packet.rnd), EM_ENC_CLEAR_LEN, client->key, &len);
-            if (!encdata || len != EM_ENC_ENC_LEN) em_fatal("Encrypting UDP packet failed.");
-            memcpy(&(packet.rnd), encdata, EM_ENC_ENC_LEN);
+            // Add 16 random bits to make chosen plaintext a bit harder
+            packet->rnd |= arc4random() & ~EM_STAMP_MASK;
+            size_t enclen;
+            char *encdata = xxtea_encrypt(&(packet->rnd), len, client->key, &enclen);
+            if (!encdata || enclen > EM_MAX_UDP_SIZE - 2) em_fatal("Encrypting UDP packet failed.");
+            memcpy(&(packet->rnd), encdata, enclen);
             free(encdata);
-            if (sendto(sock, &packet, EM_ENC_PACKET_LEN, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-                em_fatal("Sending encrypted UDP packet failed.");
+            packet->enc = enclen;
+            size = enclen + 2;
+        }
+
+        if (sendto(sock, buf, size, 0, (struct sockaddr *)&addr, addrlen) >= 0) return 0;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return 1;
+
+        em_trace(EM_TRACE_ERROR, -1, client->idx, event->type, event->code, event->value, errno);
+        if (!client->out_errors++) printf("Client #%u: Sending UDP packet failed with errno %d\n", client->idx, errno);
+        return -1;
+    }
+
+    // Send right away unless something is waiting ahead of the packet.
+    // The two queues share EM_QUEUE_LEN packets. When they are full,
+    // motion gives way first: the oldest queued motion is dropped, for
+    // new motion and new key packets alike. Then key repeats: a new one
+    // is dropped, or the oldest queued one makes room. Only with the
+    // queue full of other key packets is a new one dropped, which can
+    // leave a key stuck on the client unless it has "redundancy".
+    void queue_packet(em_client *client, em_queue *queue, uint8_t *buf, size_t len) {
+        struct em_packet *packet = (struct em_packet *)buf;
+        int motion = queue == &client->out_motion;
+        if (!queue->num && !(motion && client->out_keys.num)) {
+            if (transmit_packet(client, buf, len) != 1) return;
+        }
+
+        if (client->out_keys.num + client->out_motion.num == EM_QUEUE_LEN) {
+            struct em_packet removed;
+            int repeat = packet->type < EM_TYPE_PRESENCE && (packet->type & 0xff) == EV_KEY && packet->value == 2;
+            client->out_dropped++;
+            if (client->out_motion.num) {
+                removed = *(struct em_packet *)em_queue_peek(&client->out_motion)->buf;
+                em_queue_pop(&client->out_motion);
+            }
+            else if (motion || repeat || !em_queue_drop_repeat(queue, &removed)) {
+                em_trace(EM_TRACE_DROP, -1, client->idx, packet->type, packet->code, packet->value, EM_TRACE_DROP_OVERFLOW);
+                if (!motion) client->out_keys_dropped++;
+                return;
+            }
+            em_trace(EM_TRACE_DROP, -1, client->idx, removed.type, removed.code, removed.value, EM_TRACE_DROP_OVERFLOW);
+        }
+        em_queue_push(queue, buf, len);
+        client->out_queued++;
+    }
+
+    void send_remote_packet(em_client *client, uint8_t *buf, size_t len) {
+        struct em_packet *packet = (struct em_packet *)buf;
+
+        // Same host: no encryption, no backlog, the ring never blocks.
+        int bell = packet->type >= EM_TYPE_PRESENCE || ((packet->type & 0xff) == EV_SYN && packet->code == SYN_REPORT);
+        if (client->shm) {
+            em_shm_push(client->shm, buf, len + 2, bell);
+            return;
+        }
+
+        // Group members on this host don't see the datagram, their rings
+        // get a copy.
+        if (client->idx >= EM_GROUP_BASE) {
+            uint32_t bit = 1u << (client->idx - EM_GROUP_BASE);
+            for (int c = 0; c < config->num_clients; c++) {
+                em_client *member = &config->clients[c];
+                if (member->shm && (member->groups & bit)) em_shm_push(member->shm, buf, len + 2, bell);
+            }
+        }
+
+        // A frame ends in each queue that holds part of it.
+        if (packet->type < EM_TYPE_PRESENCE && (packet->type & 0xff) == EV_SYN && packet->code == SYN_REPORT) {
+            int to_motion = client->frame_motion;
+            int to_keys   = client->frame_keys || !to_motion;
+            client->frame_motion = client->frame_keys = 0;
+            if (to_motion) queue_packet(client, &client->out_motion, buf, len);
+            if (to_keys) queue_packet(client, &client->out_keys, buf, len);
+        }
+        else if (em_is_motion(packet->type)) {
+            // Backed up: no point in sending stale motion step by step.
+            if (client->out_motion.num && em_queue_merge(&client->out_motion, packet->type, packet->code, packet->value)) {
+                client->out_merged++;
+                client->frame_motion = 1;
+                return;
+            }
+            queue_packet(client, &client->out_motion, buf, len);
+            if (client->out_motion.num) client->frame_motion = 1;
         }
         else {
-            if (sendto(sock, &packet, EM_CLEAR_PACKET_LEN, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-                em_fatal("Sending UDP packet failed.");
+            queue_packet(client, &client->out_keys, buf, len);
+            client->frame_keys = 1;
+        }
+    }
+
+    // Socket writable again: keys first, then motion. Groups follow the
+    // clients in the array and are drained last.
+    void drain_queues() {
+        for (int motion = 0; motion < 2; motion++) {
+            for (int c = 0; c < config->num_clients + config->num_groups; c++) {
+                em_client *client = &config->clients[c];
+                em_queue *queue = motion ? &client->out_motion : &client->out_keys;
+                em_queued *item;
+                while ((item = em_queue_peek(queue))) {
+                    if (transmit_packet(client, item->buf, item->len) == 1) return;
+                    em_queue_pop(queue);
+                }
+            }
+        }
+    }
+
+    int queued_packets() {
+        int num = 0;
+        for (int c = 0; c < config->num_clients + config->num_groups; c++)
+            num += config->clients[c].out_keys.num + config->clients[c].out_motion.num;
+        return num;
+    }
+
+    // Control message with a single extension, bypasses the keylog.
+    void send_ext_event(em_client *client, uint16_t type, uint16_t code, int32_t value, uint8_t ext_type, void *data, size_t size) {
+        uint8_t buf[EM_MAX_UDP_SIZE];
+        struct em_packet *packet = (struct em_packet *)buf;
+        struct em_ext_header *ext = (struct em_ext_header *)&buf[2 + EM_ENC_CLEAR_LEN];
+        memset(buf, 0, sizeof(buf));
+        packet->clientIdx = (uint8_t)client->idx;
+        packet->rnd       = em_now_ms() & EM_STAMP_MASK;
+        packet->type      = type;
+        packet->code      = code;
+        packet->value     = value;
+        ext->type = ext_type;
+        ext->len  = sizeof(*ext) + size;
+        memcpy(ext + 1, data, size);
+        send_remote_packet(client, buf, EM_ENC_CLEAR_LEN + ext->len);
+    }
+
+    // Send the touch slot fields that changed since the last frame.
+    // Returns the number of fields sent.
+    int send_mt_frame(em_client *client, em_device *dev) {
+        struct em_mt_entry entries[EM_MT_ENTRIES];
+        uint16_t resend[EM_MAX_MT_SLOTS];
+        int num = 0, sent = 0;
+        int absent = client->local || (client->presence && !client->present);
+
+        // Changes in a packet the full queues dropped go out with the
+        // next frame, a lost lift would leave a touch stuck on the client.
+        void send_entries() {
+            uint32_t dropped = client->out_keys_dropped;
+            send_ext_event(client, EM_TYPE_MTFRAME, dev->idx, 0, EM_EXT_MTFRAME, entries, num * sizeof(entries[0]));
+            if (client->out_keys_dropped != dropped) {
+                for (int e = 0; e < num; e++) resend[entries[e].slot_axis >> 4] |= 1 << (entries[e].slot_axis & 15);
+            }
+            else sent += num;
+            num = 0;
+        }
+        memset(resend, 0, sizeof(resend));
+
+        for (int s = 0; s < dev->mt_slots; s++) {
+            em_mt_slot *slot = &dev->mt[s];
+            if (absent) slot->changed = 0;
+            for (int a = 0; slot->changed; a++) {
+                if (!(slot->changed & (1 << a))) continue;
+                slot->changed &= ~(1 << a);
+                entries[num].slot_axis = s << 4 | a;
+                entries[num].value     = slot->value[a];
+                if (++num == EM_MT_ENTRIES) send_entries();
+            }
+        }
+        if (num) send_entries();
+        for (int s = 0; s < dev->mt_slots; s++) dev->mt[s].changed |= resend[s];
+        if (sent) em_trace(EM_TRACE_SEND, dev->idx, client->idx, EM_TYPE_MTFRAME, dev->idx, sent, 0);
+        return sent;
+    }
+
+    // Keep client->held in step with what the client was sent. Keys of
+    // mirrored devices are released by release_mirrored() instead.
+    void track_held(em_client *client, uint16_t code, int32_t value) {
+        if (code >= KEY_CNT || value > 1) return;
+        uint8_t bit = 1 << (code & 7);
+        int held = (client->held[code >> 3] & bit) != 0;
+        if (value && !held) {
+            client->held[code >> 3] |= bit;
+            client->num_held++;
+        }
+        else if (!value && held) {
+            client->held[code >> 3] &= ~bit;
+            client->num_held--;
         }
     }
 
     // Will only be called for active devices
     int send_event(em_client *client, em_device *dev, uint16_t type, uint16_t code, int32_t value) {
+        // Keys of mirrored devices go out as they are.
+        int own_key = type == EV_KEY && code < KEY_CNT && (client->local || !dev || !dev->slot_type);
+        if (own_key) code = client->keymap[code];
+
+        if (em_filter_drops(&client->filter, type, code)) {
+            em_trace(EM_TRACE_FILTER, dev ? dev->idx : -1, client->idx, type, code, value, EM_TRACE_FILTER_CLIENT);
+            return 1;
+        }
+        if (own_key) track_held(client, code, value);
+
         if (client->local) {
             if (dev) {
                 int rc = libevdev_uinput_write_event(dev->uidev, type, code, value);
+                em_trace(rc ? EM_TRACE_ERROR : EM_TRACE_SEND, dev->idx, client->idx, type, code, value, rc);
                 if (rc != 0) {
                     printf("Device #%d: Sending event failed with rc %d, deactivating.\n", dev->idx, rc);
                     return 0;
@@ -308,77 +1159,1007 @@ int main(int argc, char* argv[]) {
             }
             else {
                 int rc = libevdev_uinput_write_event(uiodev, type, code, value);
+                em_trace(rc ? EM_TRACE_ERROR : EM_TRACE_SEND, -1, client->idx, type, code, value, rc);
                 if (rc != 0) em_fatal("Sending event failed with rc %d on uinput device.", rc);
             }
         }
-        else send_remote_event(client, type, code, value);
+        else send_remote_event(client, (dev ? dev->slot_type : 0) | type, code, value);
 
         return 1;
     }
 
-    void release_pressed(em_client *client) {
-        // Send release events for pressed keys on all devices
-        if (client->local) {
-            em_device *dev = devices;
-            while (dev) {
-                if (dev->active) {
-                    for (int k = 0; k < EM_MAX_COMBO; k++) {
-                        if (active_keys[k])
-                            libevdev_uinput_write_event(dev->uidev, EV_KEY, active_keys[k], 0);
+    // Describe mirrored devices to a remote client. Sent on switching and
+    // with every device check, clients only act on complete descriptors
+    // that differ from what they have.
+    void send_descriptors(em_client *client) {
+        if (client->local || (client->presence && !client->present)) return;
+
+        void send_control(em_device *dev, int what, void *data, size_t size) {
+            send_ext_event(client, EM_TYPE_DEVICE, dev->idx, what, EM_EXT_DEVICE, data, size);
+        }
+
+        for (int d = 0; d < config->num_devices; d++) {
+            em_device *dev = &config->devices[d];
+            if (!dev->active || !dev->slot_type) continue;
+            int num = 0;
+
+            struct em_dev_info info;
+            memset(&info, 0, sizeof(info));
+            info.vendor  = libevdev_get_id_vendor(dev->evdev);
+            info.product = libevdev_get_id_product(dev->evdev);
+            info.version = libevdev_get_id_version(dev->evdev);
+            strncpy(info.name, dev->clone->name, sizeof(info.name));
+            send_control(dev, EM_DEV_INFO, &info, sizeof(info));
+            num++;
+
+            int types[] = { EV_KEY, EV_REL, EV_MSC };
+            for (int t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+                if (!libevdev_has_event_type(dev->evdev, types[t])) continue;
+                int max = libevdev_event_type_get_max(types[t]);
+                for (int chunk = 0; chunk * 256 <= max; chunk++) {
+                    struct em_dev_bits bits;
+                    memset(&bits, 0, sizeof(bits));
+                    bits.type  = types[t];
+                    bits.chunk = chunk;
+                    int any = 0;
+                    for (int c = chunk * 256; c <= max && c < (chunk + 1) * 256; c++) {
+                        if (libevdev_has_event_code(dev->evdev, types[t], c)) {
+                            bits.bits[(c & 0xff) / 32] |= 1u << (c % 32);
+                            any = 1;
+                        }
                     }
-                    libevdev_uinput_write_event(dev->uidev, EV_SYN, SYN_REPORT, 0);
+                    // Chunk 0 also announces the type itself.
+                    if (!any && chunk) continue;
+                    send_control(dev, EM_DEV_BITS, &bits, sizeof(bits));
+                    num++;
                 }
-                dev = dev->next;
             }
+
+            for (int a = 0; a < ABS_CNT; a++) {
+                const struct input_absinfo *absinfo = libevdev_get_abs_info(dev->evdev, a);
+                if (!absinfo) continue;
+                struct em_dev_abs abs;
+                abs.code       = a;
+                abs.minimum    = absinfo->minimum;
+                abs.maximum    = absinfo->maximum;
+                abs.fuzz       = absinfo->fuzz;
+                abs.flat       = absinfo->flat;
+                abs.resolution = absinfo->resolution;
+                send_control(dev, EM_DEV_ABS, &abs, sizeof(abs));
+                num++;
+            }
+
+            struct em_dev_props props;
+            props.bits = 0;
+            for (int p = 0; p < INPUT_PROP_CNT && p < 32; p++) {
+                if (libevdev_has_property(dev->evdev, p)) props.bits |= 1u << p;
+            }
+            send_control(dev, EM_DEV_PROPS, &props, sizeof(props));
+            num++;
+
+            struct em_dev_commit commit;
+            commit.num  = num + 1;
+            commit.caps = dev->clone->caps;
+            send_control(dev, EM_DEV_COMMIT, &commit, sizeof(commit));
         }
-        else {
-            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                if (active_keys[k])
-                    send_remote_event(client, EV_KEY, active_keys[k], 0);
+    }
+
+    // Gamepad buttons and touches on mirrored devices aren't tracked in
+    // client->held.
+    void release_mirrored(em_client *client) {
+        if (client->local || (client->presence && !client->present)) return;
+        for (int d = 0; d < config->num_devices; d++) {
+            em_device *dev = &config->devices[d];
+            if (!dev->active || !dev->slot_type) continue;
+            int released = 0;
+            for (int k = 0; k < KEY_CNT; k++) {
+                if (libevdev_get_event_value(dev->evdev, EV_KEY, k)) {
+                    send_remote_event(client, dev->slot_type | EV_KEY, k, 0);
+                    released++;
+                }
             }
+
+            // Lift touching fingers. The slot state stays as it is, it's
+            // sent in full when switching back.
+            struct em_mt_entry lift;
+            lift.value = -1;
+            for (int s = 0; s < dev->mt_slots; s++) {
+                if (dev->mt[s].value[ABS_MT_TRACKING_ID - EM_MT_FIRST] < 0) continue;
+                lift.slot_axis = s << 4 | (ABS_MT_TRACKING_ID - EM_MT_FIRST);
+                send_ext_event(client, EM_TYPE_MTFRAME, dev->idx, 0, EM_EXT_MTFRAME, &lift, sizeof(lift));
+                released++;
+            }
+            if (released) send_remote_event(client, dev->slot_type | EV_SYN, SYN_REPORT, 0);
+        }
+    }
+
+    // Release everything the client holds in a single frame. Local
+    // clients don't record which uinput device a key went to, releases
+    // for keys a device doesn't have down are dropped by the kernel.
+    void release_pressed(em_client *client) {
+        if (client->num_held) {
+            for (int k = 0; k < KEY_CNT; k++) {
+                if (!(client->held[k >> 3] & (1 << (k & 7)))) continue;
+                if (client->local) {
+                    for (int d = 0; d < config->num_devices; d++) {
+                        em_device *dev = &config->devices[d];
+                        if (dev->active) libevdev_uinput_write_event(dev->uidev, EV_KEY, k, 0);
+                    }
+                    libevdev_uinput_write_event(uiodev, EV_KEY, k, 0);
+                }
+                else send_remote_event(client, EV_KEY, k, 0);
+            }
+            if (client->local) {
+                for (int d = 0; d < config->num_devices; d++) {
+                    em_device *dev = &config->devices[d];
+                    if (dev->active) libevdev_uinput_write_event(dev->uidev, EV_SYN, SYN_REPORT, 0);
+                }
+                libevdev_uinput_write_event(uiodev, EV_SYN, SYN_REPORT, 0);
+            }
+            else send_remote_event(client, EV_SYN, SYN_REPORT, 0);
+            em_trace(EM_TRACE_MARK, -1, client->idx, 0, EM_TRACE_MARK_RELEASE, 0, client->num_held);
+            memset(client->held, 0, sizeof(client->held));
+            client->num_held = 0;
         }
         for (int k = 0; k < EM_MAX_COMBO; k++) { active_keys[k] = 0; };
     }
 
+    em_client *mapping_client(em_mapping *mapping) {
+        if (mapping->always_group && mapping->always_group <= config->num_groups)
+            return &config->groups[mapping->always_group - 1];
+        if (mapping->always_client) {
+            em_client *c = em_client_by_idx(config, mapping->always_client - 1);
+            if (c) return c;
+        }
+        return active_client;
+    }
+
+    void send_step(em_client *client, em_step *step) {
+        if (step->code >= 0x400) {
+            switch (step->code) {
+                case 0x400:
+                    send_event(client, NULL, EV_REL, REL_WHEEL, 1);
+                break;
+                case 0x401:
+                    send_event(client, NULL, EV_REL, REL_HWHEEL, 1);
+                break;
+                case 0x402:
+                    send_event(client, NULL, EV_REL, REL_WHEEL, -1);
+                break;
+                case 0x403:
+                    send_event(client, NULL, EV_REL, REL_HWHEEL, -1);
+                break;
+            }
+        }
+        else send_event(client, NULL, step->type, step->code, step->value);
+    }
+
+    // Play a macro up to its next pause. Runs from the timer wheel, so
+    // live input keeps flowing, and each client has its own player.
+    void macro_play(em_timer *timer) {
+        em_client *client = timer->data;
+        em_mapping *mapping = client->macro;
+        if (!mapping) return;
+
+        int sent = 0;
+        while (client->macro_step < mapping->num_output) {
+            em_step *step = &mapping->output[client->macro_step++];
+            send_step(client, step);
+            sent++;
+            int pause = step->delay_ms + mapping->step_ms;
+            if (pause) {
+                send_event(client, NULL, EV_SYN, SYN_REPORT, 0);
+                em_timer_arm(timer, em_now_ms() + pause);
+                return;
+            }
+        }
+        if (sent) send_event(client, NULL, EV_SYN, SYN_REPORT, 0);
+
+        if (++client->macro_round < mapping->repeat) {
+            client->macro_step = 0;
+            em_timer_arm(timer, em_now_ms());
+            return;
+        }
+        client->macro = NULL;
+    }
+
+    // A new macro for a client replaces the one still playing.
+    void macro_start(em_client *client, em_mapping *mapping) {
+        em_timer_cancel(&client->macro_timer);
+        client->macro       = mapping;
+        client->macro_step  = 0;
+        client->macro_round = 0;
+        client->macro_timer.cb   = macro_play;
+        client->macro_timer.data = client;
+        macro_play(&client->macro_timer);
+    }
+
+    // Macros point into the mappings, they end with the configuration.
+    void macro_reset() {
+        for (int c = 0; c < config->num_clients + config->num_groups; c++) {
+            em_timer_cancel(&config->clients[c].macro_timer);
+            config->clients[c].macro = NULL;
+        }
+    }
+
+    // Timed mappings (tap/hold and key sequences). Only keys marked in
+    // timed_keys[] take this path, plus any key while a decision is
+    // pending. Everything else is forwarded without delay.
+    uint8_t timed_keys[KEY_CNT];
+    uint8_t timed_swallow[KEY_CNT];
+    memset(timed_keys, 0, sizeof(timed_keys));
+    memset(timed_swallow, 0, sizeof(timed_swallow));
+    int timed_pending   = 0; // Undecided tap/hold mappings
+    int timed_swallowed = 0; // Consumed presses still waiting for their release
+
+    int seq_keys[EM_MAX_SEQUENCE];
+    int seq_len = 0;
+    em_timer seq_timer;
+    memset(&seq_timer, 0, sizeof(seq_timer));
+
+    void timed_send(em_client *client, em_device *dev, int code, int value) {
+        // The device may have gone away while the decision was pending.
+        if (dev && !dev->active) dev = NULL;
+        send_event(client, dev, EV_KEY, code, value);
+        send_event(client, dev, EV_SYN, SYN_REPORT, 0);
+    }
+
+    void timed_swallow_release(int code) {
+        if (!timed_swallow[code]) timed_swallowed++;
+        timed_swallow[code] = 1;
+    }
+
+    void hold_start(em_mapping *mapping) {
+        em_timer_cancel(&mapping->timer);
+        mapping->timed_state = EM_TIMED_HOLDING;
+        timed_pending--;
+        timed_send(mapping->timed_client, mapping->timed_dev, mapping->hold_code, 1);
+    }
+
+    void hold_expired(em_timer *timer) {
+        em_mapping *mapping = timer->data;
+        if (mapping->timed_state == EM_TIMED_PENDING) hold_start(mapping);
+    }
+
+    // Forget held tap/hold keys, used when switching away from a client.
+    // release_pressed() and release_mirrored() have usually released them
+    // already, only keys still in client->held are released here.
+    void hold_release(em_client *client) {
+        for (int m = 0; m < config->num_mappings; m++) {
+            em_mapping *mapping = &config->mappings[m];
+            if (mapping->timed_state == EM_TIMED_HOLDING && mapping->timed_client == client) {
+                int code = client->keymap[mapping->hold_code];
+                if (client->held[code >> 3] & (1 << (code & 7)))
+                    timed_send(client, mapping->timed_dev, mapping->hold_code, 0);
+                mapping->timed_state = EM_TIMED_IDLE;
+            }
+        }
+    }
+
+    // Unfinished sequence: hand the swallowed keys to the client after all.
+    void seq_abort() {
+        em_timer_cancel(&seq_timer);
+        for (int k = 0; k < seq_len; k++) {
+            send_event(active_client, NULL, EV_KEY, seq_keys[k], 1);
+            send_event(active_client, NULL, EV_KEY, seq_keys[k], 0);
+        }
+        if (seq_len) send_event(active_client, NULL, EV_SYN, SYN_REPORT, 0);
+        seq_len = 0;
+    }
+
+    void seq_expired(em_timer *timer) {
+        seq_abort();
+    }
+    seq_timer.cb = seq_expired;
+
+    // Returns 1 if the key event was consumed by a timed mapping.
+    int timed_key(em_device *dev, struct input_event *ev) {
+        uint64_t now = em_now_ms();
+        em_mapping *mapping;
+
+        // Repeats and releases of keys whose press we consumed
+        if (timed_swallow[ev->code] && ev->value != 1) {
+            if (ev->value) return 1;
+
+            timed_swallow[ev->code] = 0;
+            timed_swallowed--;
+
+            for (int m = 0; m < config->num_mappings; m++) {
+                mapping = &config->mappings[m];
+                if (mapping->combo[0] == ev->code) {
+                    if (mapping->timed_state == EM_TIMED_PENDING) {
+                        em_timer_cancel(&mapping->timer);
+                        timed_pending--;
+                        if (now - mapping->timed_since <= mapping->tap_ms || !mapping->tap_ms)
+                            mapping->send_output = 1;
+                    }
+                    else if (mapping->timed_state == EM_TIMED_HOLDING)
+                        timed_send(mapping->timed_client, mapping->timed_dev, mapping->hold_code, 0);
+                    mapping->timed_state = EM_TIMED_IDLE;
+                }
+            }
+            return 1;
+        }
+        if (ev->value != 1) return 0;
+
+        // Pressing another key while a tap/hold is undecided makes it a hold.
+        if (timed_pending) {
+            for (int m = 0; m < config->num_mappings; m++) {
+                mapping = &config->mappings[m];
+                if (mapping->timed_state == EM_TIMED_PENDING) hold_start(mapping);
+            }
+        }
+
+        // Continue a started sequence
+        if (seq_len) {
+            int prefix = 0;
+            int timeout = 0;
+            for (int m = 0; m < config->num_mappings; m++) {
+                mapping = &config->mappings[m];
+                if (!mapping->sequence[0] || mapping->sequence[seq_len] != ev->code)
+                    goto NEXT_SEQ;
+                for (int k = 0; k < seq_len; k++) {
+                    if (mapping->sequence[k] != seq_keys[k]) goto NEXT_SEQ;
+                }
+
+                if (seq_len + 1 == EM_MAX_SEQUENCE || !mapping->sequence[seq_len + 1]) {
+                    // Complete
+                    mapping->send_output = 1;
+                    em_timer_cancel(&seq_timer);
+                    seq_len = 0;
+                    timed_swallow_release(ev->code);
+                    return 1;
+                }
+                prefix = 1;
+                if (mapping->sequence_ms > timeout) timeout = mapping->sequence_ms;
+
+                NEXT_SEQ:;
+            }
+
+            if (prefix) {
+                seq_keys[seq_len++] = ev->code;
+                timed_swallow_release(ev->code);
+                em_timer_arm(&seq_timer, now + timeout);
+                return 1;
+            }
+
+            // No sequence continues with this key.
+            seq_abort();
+        }
+
+        if (!timed_keys[ev->code]) return 0;
+
+        // Start a tap/hold decision
+        for (int m = 0; m < config->num_mappings; m++) {
+            mapping = &config->mappings[m];
+            if (mapping->hold_ms && mapping->combo[0] == ev->code
+                && mapping->timed_state == EM_TIMED_IDLE
+                && !(mapping->only_device && mapping->only_device != (dev->entry+1))) {
+                mapping->timed_state  = EM_TIMED_PENDING;
+                mapping->timed_since  = now;
+                mapping->timed_dev    = dev;
+                mapping->timed_client = mapping_client(mapping);
+                em_timer_arm(&mapping->timer, now + mapping->hold_ms);
+                timed_pending++;
+                timed_swallow_release(ev->code);
+                return 1;
+            }
+        }
+
+        // Sequences only start on a key pressed on its own.
+        for (int k = 0; k < EM_MAX_COMBO; k++) {
+            if (active_keys[k]) return 0;
+        }
+        int timeout = 0;
+        for (int m = 0; m < config->num_mappings; m++) {
+            mapping = &config->mappings[m];
+            if (mapping->sequence[0] == ev->code && mapping->sequence_ms > timeout
+                && !(mapping->only_device && mapping->only_device != (dev->entry+1)))
+                timeout = mapping->sequence_ms;
+        }
+        if (!timeout) return 0;
+
+        seq_keys[0] = ev->code;
+        seq_len = 1;
+        timed_swallow_release(ev->code);
+        em_timer_arm(&seq_timer, now + timeout);
+        return 1;
+    }
+
+    void timed_setup() {
+        memset(timed_keys, 0, sizeof(timed_keys));
+        for (int m = 0; m < config->num_mappings; m++) {
+            em_mapping *mapping = &config->mappings[m];
+            mapping->timer.cb   = hold_expired;
+            mapping->timer.data = mapping;
+            if (mapping->hold_ms) timed_keys[mapping->combo[0]] = 1;
+            if (mapping->sequence[0]) timed_keys[mapping->sequence[0]] = 1;
+        }
+    }
+    timed_setup();
+
+    // Drop all pending decisions and held tap/hold keys.
+    void timed_reset() {
+        for (int m = 0; m < config->num_mappings; m++) {
+            em_mapping *mapping = &config->mappings[m];
+            em_timer_cancel(&mapping->timer);
+            if (mapping->timed_state == EM_TIMED_HOLDING)
+                timed_send(mapping->timed_client, mapping->timed_dev, mapping->hold_code, 0);
+            mapping->timed_state = EM_TIMED_IDLE;
+        }
+        timed_pending = 0;
+        seq_abort();
+    }
+
+    // Grab devices while a remote client is active, see local_passthrough.
+    void update_grabs() {
+        int grab = !(config->local_passthrough && active_client->local);
+        for (int d = 0; d < config->num_devices; d++) {
+            if (config->devices[d].active) em_device_grab(&config->devices[d], grab);
+        }
+    }
+
+    void switch_to(em_client *client) {
+        em_trace(EM_TRACE_SWITCH, -1, client->idx, 0, 0, 0, active_client->idx);
+        release_pressed(active_client);
+        release_mirrored(active_client);
+        hold_release(active_client);
+        printf("Switching to client #%u\n", client->idx);
+        active_client = client;
+        update_grabs();
+        send_descriptors(active_client);
+        for (int d = 0; d < config->num_devices; d++) {
+            if (config->devices[d].active) em_mt_refresh(&config->devices[d]);
+        }
+    }
+
+    // Presence tracking. A client is present as long as its announcements
+    // keep arriving within presence_timeout_ms.
+    em_timer presence_timer;
+    memset(&presence_timer, 0, sizeof(presence_timer));
+
+    void presence_receive() {
+        struct em_packet packet;
+        while (1) {
+            ssize_t n = recv(psock, &packet, sizeof(packet), 0);
+            if (n < 0) break;
+            if (n < EM_CLEAR_PACKET_LEN) continue;
+
+            em_client *client = em_client_by_idx(config, packet.clientIdx);
+            if (!client || !client->presence) continue;
+
+            // Keyed clients must announce encrypted, with their own key.
+            if (client->key) {
+                if (packet.enc != EM_ENC_ENC_LEN || n < EM_ENC_PACKET_LEN) continue;
+                size_t len;
+                unsigned char *decdata = xxtea_decrypt(&(packet.rnd), EM_ENC_ENC_LEN, client->key, &len);
+                if (!decdata) continue;
+                if (len == EM_ENC_CLEAR_LEN) memcpy(&(packet.rnd), decdata, EM_ENC_CLEAR_LEN);
+                free(decdata);
+                if (len != EM_ENC_CLEAR_LEN) continue;
+            }
+            else if (packet.enc) continue;
+
+            if (packet.type != EM_TYPE_PRESENCE) continue;
+
+            client->last_seen = em_now_ms();
+            if (!client->present) {
+                client->present = 1;
+                printf("Client #%u: present\n", client->idx);
+            }
+        }
+    }
+
+    void presence_check(em_timer *timer) {
+        uint64_t now = em_now_ms();
+        for (int c = 0; c < config->num_clients; c++) {
+            em_client *client = &config->clients[c];
+            if (!client->present || now - client->last_seen <= config->presence_timeout_ms)
+                continue;
+
+            client->present = 0;
+            printf("Client #%u: absent\n", client->idx);
+
+            if (client == active_client && config->presence_fallback) {
+                em_client *local = em_local_client(config);
+                if (local) switch_to(local);
+            }
+        }
+
+        int interval = config->presence_timeout_ms / 4;
+        em_timer_arm(&presence_timer, now + (interval > 50 ? interval : 50));
+    }
+    presence_timer.cb = presence_check;
+
+    void presence_setup() {
+        if (em_config_uses_presence(config)) presence_check(&presence_timer);
+        else em_timer_cancel(&presence_timer);
+    }
+    presence_setup();
+
+    // Event processing stages, see octopus-stage.h. Frames read from a
+    // device go through pipeline[]: the built-in stages around the plugin
+    // stages of the current config.
+    struct input_event frame_events[EM_FRAME_EVENTS];
+    octopus_frame dev_frame;
+    memset(&dev_frame, 0, sizeof(dev_frame));
+    dev_frame.events = frame_events;
+    dev_frame.max    = EM_FRAME_EVENTS;
+    em_device *frame_dev = NULL;
+
+    // Set when a client combo was pressed, switched to after the events
+    // read in this round are through.
+    em_client *switch_client = NULL;
+
+    // Device "drop_events" the kernel mask let through, and resync
+    // events, which it doesn't apply to. Also the releases written by
+    // em_device_grab(): the keys went down before the grab, clients
+    // never saw them pressed.
+    void stage_drop_run(em_stage *stage, octopus_frame *frame) {
+        uint32_t kept = 0;
+        for (uint32_t e = 0; e < frame->num; e++) {
+            struct input_event *ie = &frame->events[e];
+            if (em_filter_drops(&frame_dev->filter, ie->type, ie->code)) {
+                em_trace(EM_TRACE_FILTER, frame_dev->idx, -1, ie->type, ie->code, ie->value, EM_TRACE_FILTER_DEVICE);
+                continue;
+            }
+            if (ie->type == EV_KEY && ie->value == 0 && ie->code < KEY_CNT
+                && (frame_dev->injected[ie->code >> 3] & (1 << (ie->code & 7)))) {
+                frame_dev->injected[ie->code >> 3] &= ~(1 << (ie->code & 7));
+                em_trace(EM_TRACE_FILTER, frame_dev->idx, -1, ie->type, ie->code, ie->value, EM_TRACE_FILTER_INJECTED);
+                continue;
+            }
+            if (kept != e) frame->events[kept] = *ie;
+            kept++;
+        }
+        frame->num = kept;
+    }
+
+    // Everything past the plugins, one event at a time: timed mappings,
+    // combos and sending all depend on what the events before did.
+    // Returns 0 if the device failed.
+    int route_event(em_device *dev, em_client *target, struct input_event ie) {
+        em_trace_now = (uint64_t)ie.time.tv_sec * 1000000 + ie.time.tv_usec;
+
+        // Keystate evaluation, set up active_keys[]
+
+        // printf("t:%s c:%s v:%d\n",
+        //     libevdev_event_type_get_name(ie.type),
+        //     libevdev_event_code_get_name(ie.type, ie.code),
+        //     ie.value
+        // );
+
+        // Timed mappings
+        if (ie.type == EV_KEY && (timed_keys[ie.code] || timed_pending || seq_len || timed_swallowed)) {
+            if (timed_key(dev, &ie)) {
+                em_trace(EM_TRACE_TIMED, dev->idx, -1, ie.type, ie.code, ie.value, 0);
+                return 1;
+            }
+        }
+
+        // Absolute axes: drop what didn't change, and frames
+        // that end up empty. Only done for mirrored devices.
+        // Touch slots are diffed, remote clients get the
+        // changes batched ahead of the SYN_REPORT.
+        if (dev->slot_type) {
+            if (ie.type == EV_ABS && dev->mt_slots && ie.code >= ABS_MT_SLOT && ie.code <= EM_MT_LAST) {
+                em_mt_update(dev, &ie);
+                if (!target->local) return 1;
+            }
+            else if (ie.type == EV_ABS && !em_axis_filter(dev, &ie)) return 1;
+            if (ie.type == EV_SYN && ie.code == SYN_REPORT) {
+                if (send_mt_frame(target, dev)) dev->frame_events++;
+                if (!dev->frame_events) return 1;
+                dev->frame_events = 0;
+            }
+            else dev->frame_events++;
+        }
+
+        int check_combos = 0;
+        int filter = 0;
+        struct input_event aie = ie;
+
+        if (ie.type == EV_REL && ie.code == REL_WHEEL) {
+            if (ie.value > 0) { aie.type = EV_KEY; aie.code = 0x400; aie.value = 1; };
+            if (ie.value < 0) { aie.type = EV_KEY; aie.code = 0x402; aie.value = 1; };
+        }
+        if (ie.type == EV_REL && ie.code == REL_HWHEEL) {
+            if (ie.value > 0) { aie.type = EV_KEY; aie.code = 0x401; aie.value = 1; };
+            if (ie.value < 0) { aie.type = EV_KEY; aie.code = 0x403; aie.value = 1; };
+        }
+
+        if (aie.type == EV_KEY && aie.value < 2) {
+            if (aie.value) {
+                // Key pressed
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                    if (!active_keys[k] || active_keys[k] == aie.code) {
+                        active_keys[k] = aie.code;
+                        check_combos = 1;
+                        break;
+                    };
+                }
+            }
+            else {
+                // Key released
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                    if (active_keys[k] == aie.code) active_keys[k] = 0;
+                }
+                if (dev->filter_release_code == aie.code) {
+                    filter = 1;
+                    dev->filter_release_code = 0;
+                }
+            }
+        }
+
+        // printf("\nActive keys: ");
+        // for (int k = 0; k < EM_MAX_COMBO; k++) {
+        //     if (active_keys[k])
+        //         printf("%s ", em_event_code_get_name(active_keys[k]));
+        // }
+
+        if (check_combos) {
+
+            // Check mapping combos
+            for (int m = 0; m < config->num_mappings; m++) {
+                em_mapping *mapping = &config->mappings[m];
+
+                // If only_device is set, check if we need to ignore this mapping.
+                if (mapping->only_device && mapping->only_device != (dev->entry+1))
+                    goto NEXT_MAPPING;
+
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                    if (active_keys[k] && !check_combo_array(mapping->combo, active_keys[k]))
+                        goto NEXT_MAPPING;
+                }
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                    if (mapping->combo[k] && !check_combo_array(active_keys, mapping->combo[k]))
+                        goto NEXT_MAPPING;
+                }
+
+                // Mark to send output event sequence
+                mapping->send_output = 1;
+                em_trace(EM_TRACE_MAPPING, dev->idx, -1, aie.type, aie.code, aie.value, m);
+                if (mapping->filter_last) filter = 1;
+
+                NEXT_MAPPING:;
+            }
+
+            // Check client combos
+            for (int c = 0; c < config->num_clients; c++) {
+                em_client *client = &config->clients[c];
+
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                    if (active_keys[k] && !check_combo_array(client->combo, active_keys[k]))
+                        goto NEXT_CLIENT;
+                }
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                    if (client->combo[k] && !check_combo_array(active_keys, client->combo[k]))
+                        goto NEXT_CLIENT;
+                }
+
+                // Switch clients
+                switch_client = client;
+                filter = 1; // Always filter switch combos
+
+                NEXT_CLIENT:;
+            }
+        }
+
+        // Forward event to output if we don't want it filtered
+        if (filter) {
+            em_trace(EM_TRACE_FILTER, dev->idx, target->idx, ie.type, ie.code, ie.value, EM_TRACE_FILTER_COMBO);
+            // When filtering keypress ...
+            if (ie.value > 0) {
+                // ... remember to filter the release as well.
+                dev->filter_release_code = ie.code;
+                // ... remove filtered keypress from active_keys
+                for (int k = 0; k < EM_MAX_COMBO; k++) {
+                   if (active_keys[k] >= ie.code) active_keys[k] = 0;
+                }
+            }
+        }
+        // Ungrabbed, the desktop already has the event.
+        else if (dev->grabbed || !target->local) {
+            if (!send_event(target, dev, ie.type, ie.code, ie.value)) {
+                // Something wrong with the device
+                dev->active = 0;
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    void stage_route_run(em_stage *stage, octopus_frame *frame) {
+        // Plugins may send the frame somewhere else than the active client.
+        em_client *target = frame->client >= 0 ? em_client_by_idx(config, frame->client) : NULL;
+        if (!target) target = active_client;
+        for (uint32_t e = 0; e < frame->num; e++) {
+            if (!route_event(frame_dev, target, frame->events[e])) return;
+        }
+    }
+
+    em_stage stage_drop  = { .name = "drop",  .run = stage_drop_run };
+    em_stage stage_route = { .name = "route", .run = stage_route_run };
+    em_stage *pipeline[EM_MAX_STAGES + 2];
+    int num_pipeline = 0;
+
+    void pipeline_setup() {
+        num_pipeline = 0;
+        pipeline[num_pipeline++] = &stage_drop;
+        for (int s = 0; s < config->num_stages; s++) pipeline[num_pipeline++] = &config->stages[s];
+        pipeline[num_pipeline++] = &stage_route;
+    }
+    pipeline_setup();
+
+    // Runs the frame read from dev through all stages and empties it.
+    // Returns 0 if the device failed on the way.
+    int pipeline_run(em_device *dev) {
+        frame_dev        = dev;
+        dev_frame.device = dev->entry + 1;
+        dev_frame.node   = dev->node;
+        dev_frame.client = -1;
+        for (int s = 0; s < num_pipeline && dev_frame.num; s++) em_stage_run(pipeline[s], &dev_frame);
+        dev_frame.num = 0;
+        return dev->active;
+    }
+
+    void dump_status() {
+        uint64_t now = em_now_ms();
+        printf("Status: active client #%u\n", active_client->idx);
+        for (int d = 0; d < config->num_devices; d++) {
+            em_device *dev = &config->devices[d];
+            if (dev->active) printf("Device #%d: active on %s\n", dev->idx, dev->info->device);
+            else printf("Device #%d: inactive\n", dev->idx);
+        }
+        for (int c = 0; c < config->num_clients; c++) {
+            em_client *client = &config->clients[c];
+            printf("Client #%u: ", client->idx);
+            if (client->local) printf("local");
+            else if (client->shm) printf("shared memory at %s, %llu packets", client->shm->path,
+                (unsigned long long)client->shm->head);
+            else if (!client->presence) printf("remote");
+            else if (!client->last_seen) printf("remote, never seen");
+            else printf("remote, %s, last seen %llums ago", client->present ? "present" : "absent",
+                (unsigned long long)(now - client->last_seen));
+            if (client->num_held) printf(", %d keys held", client->num_held);
+            if (!client->local && !client->shm)
+                printf(", %d+%d queued, %u queued total, %u merged, %u dropped, %u errors",
+                    client->out_keys.num, client->out_motion.num,
+                    client->out_queued, client->out_merged, client->out_dropped, client->out_errors);
+            printf("%s\n", client == active_client ? " (active)" : "");
+        }
+        for (int g = 0; g < config->num_groups; g++) {
+            em_client *group = &config->groups[g];
+            int members = 0;
+            for (int c = 0; c < config->num_clients; c++) {
+                if (config->clients[c].groups & (1u << g)) members++;
+            }
+            printf("Group #%d: %s, %d members, %d+%d queued, %u queued total, %u merged, %u dropped, %u errors\n",
+                g, group->name, members, group->out_keys.num, group->out_motion.num,
+                group->out_queued, group->out_merged, group->out_dropped, group->out_errors);
+        }
+        for (int s = 0; s < num_pipeline; s++) {
+            em_stage *stage = pipeline[s];
+            printf("Stage %s: %llu frames, %llu events, %.1fus average, %.1fus max\n", stage->name,
+                (unsigned long long)stage->frames, (unsigned long long)stage->events,
+                stage->frames ? stage->total_ns / 1000.0 / stage->frames : 0.0, stage->max_ns / 1000.0);
+        }
+    }
+
+    // Swap in a freshly parsed configuration between events. Devices that
+    // are still configured keep their grab and uinput clone, the active
+    // client and held keys carry over. Returns 1 if the config was swapped.
+    int reload_config() {
+        em_config * volatile new_config = NULL;
+        jmp_buf jmp;
+        if (setjmp(jmp)) {
+            em_fatal_jmp = NULL;
+            // Undo what was set up for the broken config.
+            if (new_config) {
+                em_stages_close(new_config);
+                shm_close_unused(new_config, config);
+                em_config_free(new_config);
+            }
+            else jsmn_cfg_abort();
+            printf("Reload failed, keeping current configuration.\n");
+            return 0;
+        }
+        em_fatal_jmp = &jmp;
+        new_config = em_load_config(argv[1]);
+        shm_setup(new_config, config);
+        if (psock < 0 && em_config_uses_presence(new_config)) psock = em_presence_socket(&transport);
+        em_stages_open(new_config);
+        em_fatal_jmp = NULL;
+        if (em_transport_changed(&transport, &new_config->transport))
+            printf("Transport changes take effect after a restart.\n");
+
+        // Keep what we know about clients that are still there. Groups
+        // are matched by their position.
+        for (int c = 0; c < new_config->num_clients + new_config->num_groups; c++) {
+            em_client *client = &new_config->clients[c];
+            em_client *old = em_client_by_idx(config, client->idx);
+            if (client->idx >= EM_GROUP_BASE && client->idx - EM_GROUP_BASE < config->num_groups)
+                old = &config->groups[client->idx - EM_GROUP_BASE];
+            if (client->presence && old && old->presence) {
+                client->present   = old->present;
+                client->last_seen = old->last_seen;
+            }
+            if (old) {
+                client->out_keys     = old->out_keys;
+                client->out_motion   = old->out_motion;
+                client->frame_keys   = old->frame_keys;
+                client->frame_motion = old->frame_motion;
+                client->out_queued   = old->out_queued;
+                client->out_merged   = old->out_merged;
+                client->out_dropped  = old->out_dropped;
+                client->out_errors   = old->out_errors;
+                memcpy(client->held, old->held, sizeof(client->held));
+                client->num_held     = old->num_held;
+                client->frame_open   = old->frame_open;
+            }
+            if (client->redundancy && old && old->redundancy) {
+                client->key_seq    = old->key_seq;
+                client->keylog_num = old->keylog_num < client->redundancy ? old->keylog_num : client->redundancy;
+                memcpy(client->keylog, &old->keylog[old->keylog_num - client->keylog_num],
+                    client->keylog_num * sizeof(client->keylog[0]));
+            }
+        }
+
+        // Pending timed decisions and macros point into the old mappings.
+        timed_reset();
+        macro_reset();
+
+        em_client *new_active = em_client_by_idx(new_config, active_client->idx);
+        if (!new_active) {
+            release_pressed(active_client);
+            new_active = &new_config->clients[0];
+            printf("Switching to client #%u\n", new_active->idx);
+        }
+
+        // Old devices go to the first new entry for the same device, into
+        // its first device without a node or one added for them.
+        for (int o = 0; o < config->num_devices; o++) {
+            em_device *old = &config->devices[o];
+            if (!old->active) continue;
+            for (int d = 0; d < new_config->num_devices; d++) {
+                em_device *dev = &new_config->devices[d];
+                if (dev->node != 0 || !em_device_same(old, dev)) continue;
+                while (dev && dev->active) dev = dev->next_node;
+                if (!dev) dev = em_add_node(new_config, &new_config->devices[d]);
+                if (dev) {
+                    dev->active              = 1;
+                    dev->evfd                = old->evfd;
+                    dev->evdev               = old->evdev;
+                    dev->clone               = old->clone;
+                    dev->uidev               = old->uidev;
+                    dev->filter_release_code = old->filter_release_code;
+                    dev->grabbed             = old->grabbed;
+                    memcpy(dev->injected, old->injected, sizeof(dev->injected));
+                    dev->slot_type           = old->slot_type;
+                    dev->frame_events        = old->frame_events;
+                    dev->mt_slots            = old->mt_slots;
+                    dev->mt_slot             = old->mt_slot;
+                    memcpy(dev->mt, old->mt, EM_MAX_MT_SLOTS * sizeof(em_mt_slot));
+                    memcpy(dev->info->device, old->info->device, sizeof(dev->info->device));
+                    // The new entry may drop different events.
+                    em_device_mask(dev, 1);
+                    old->active = 0;
+                    old->evfd   = 0;
+                    old->evdev  = NULL;
+                    old->clone  = NULL;
+                    old->uidev  = NULL;
+                    printf("Device #%d: Keeping device node %s\n", dev->idx, dev->info->device);
+                    break;
+                }
+            }
+        }
+
+        for (int o = 0; o < config->num_devices; o++) {
+            em_device *old = &config->devices[o];
+            if (old->active) printf("Device #%d: Removed from configuration\n", old->idx);
+            em_release_device(old);
+        }
+
+        em_config *old_config = config;
+        config        = new_config;
+        active_client = new_active;
+        timed_setup();
+        presence_setup();
+        pipeline_setup();
+        shm_close_unused(old_config, config);
+        em_stages_close(old_config);
+        em_config_free(old_config);
+        em_clone_prune(config);
+
+        em_trace_set_file(config->trace_file);
+        em_trace(EM_TRACE_MARK, -1, active_client->idx, 0, EM_TRACE_MARK_RELOAD, 0, 0);
+        printf("Configuration reloaded.\n");
+        return 1;
+    }
+
+    struct pollfd *pollfds = NULL;
+
     // Main loop
     while (1) {
         NEXT_GRAB:
 
         // Check if new devices have shown up
-        em_grab_devices(devices);
+        em_grab_devices(config);
+        update_grabs();
+        send_descriptors(active_client);
+        em_trace_clock();
+        em_trace(EM_TRACE_MARK, -1, -1, 0, EM_TRACE_MARK_GRAB, 0, 0);
 
         // Set up pollfds
-        struct pollfd pollfds[EM_MAX_DEVICES];
-        memset(pollfds, 0, sizeof(pollfds));
+        if (pollfds) free(pollfds);
+        pollfds = em_malloc((config->num_devices + config->num_clients * EM_SHM_POLLFDS + 2) * sizeof(struct pollfd));
         int num_pollfds = 0;
-        em_device * dev = devices;
-        while (dev) {
+        for (int d = 0; d < config->num_devices; d++) {
+            em_device *dev = &config->devices[d];
             if (dev->active) {
                 dev->pollfd_idx = num_pollfds;
                 pollfds[dev->pollfd_idx].fd = dev->evfd;
                 pollfds[dev->pollfd_idx].events = POLLIN;
                 num_pollfds++;
             }
-            dev = dev->next;
         }
+        int presence_pollfd_idx = -1;
+        if (psock >= 0) {
+            presence_pollfd_idx = num_pollfds;
+            pollfds[presence_pollfd_idx].fd = psock;
+            pollfds[presence_pollfd_idx].events = POLLIN;
+            num_pollfds++;
+        }
+        for (int c = 0; c < config->num_clients; c++) {
+            if (config->clients[c].shm) config->clients[c].shm->pollfd_idx = -1;
+        }
+        for (int c = 0; c < config->num_clients; c++) {
+            em_shm *shm = config->clients[c].shm;
+            if (!shm || shm->pollfd_idx >= 0) continue;
+            shm->pollfd_idx = num_pollfds;
+            em_shm_pollfds(shm, &pollfds[shm->pollfd_idx]);
+            num_pollfds += EM_SHM_POLLFDS;
+        }
+        int sock_pollfd_idx = num_pollfds;
+        pollfds[sock_pollfd_idx].fd = sock;
+        num_pollfds++;
 
         time_t last_device_check = time(NULL);
-        em_client *switch_client = NULL;
+        switch_client = NULL;
 
         // poll() loop, quit for device regrab every five seconds
         while (1) {
-            int rc = poll(pollfds, num_pollfds, 1000);
+            // Wait for the socket only while something is queued.
+            pollfds[sock_pollfd_idx].events = queued_packets() ? POLLOUT : 0;
+            int rc = poll(pollfds, num_pollfds, em_timer_timeout(1000));
             // All but EINTR are deadly
             if (rc < 0 && errno != EINTR) em_fatal("poll() failed with errno %d\n", errno);
-            // poll() timeout
-            if (rc == 0) goto NEXT_POLL;
+            em_trace_clock();
+
+            // Serve timed mappings
+            em_timer_run();
+
+            // poll() timeout or signal
+            if (rc <= 0) goto SEND_OUTPUT;
+
+            if (presence_pollfd_idx >= 0 && (pollfds[presence_pollfd_idx].revents & POLLIN))
+                presence_receive();
+
+            if (pollfds[sock_pollfd_idx].revents & POLLOUT)
+                drain_queues();
 
-            dev = devices;
+            for (int c = 0; c < config->num_clients; c++) {
+                em_shm *shm = config->clients[c].shm;
+                if (shm && shm->pollfd_idx >= 0) em_shm_serve(shm, &pollfds[shm->pollfd_idx]);
+            }
+
+            for (int d = 0; d < config->num_devices; d++) {
+                em_device *dev = &config->devices[d];
 
-            while (dev) {
                 // Skip nonexistant devices
                 if (!dev->active)
-                    goto NEXT_DEV;
+                    continue;
 
                 // Check for errors
                 if ( (pollfds[dev->pollfd_idx].revents & POLLERR) ||
@@ -391,13 +2172,16 @@ int main(int argc, char* argv[]) {
 
                 // Check for readable events
                 if (!(pollfds[dev->pollfd_idx].revents & POLLIN))
-                    goto NEXT_DEV;
+                    continue;
 
                 int mode = LIBEVDEV_READ_FLAG_NORMAL;
                 while (1) {
                     struct input_event ie;
                     rc = libevdev_next_event(dev->evdev, mode, &ie);
                     if (rc < 0) break;
+                    em_trace_now = (uint64_t)ie.time.tv_sec * 1000000 + ie.time.tv_usec;
+                    em_trace(EM_TRACE_EVENT, dev->idx, -1, ie.type, ie.code, ie.value, rc);
+
                     if (rc == LIBEVDEV_READ_STATUS_SYNC && mode == LIBEVDEV_READ_FLAG_NORMAL) {
                         // Resynch device
                         printf("Device #%d: resyncing\n", dev->idx);
@@ -405,127 +2189,15 @@ int main(int argc, char* argv[]) {
                         continue;
                     }
 
-                    // Keystate evaluation, set up active_keys[]
-
-                    // printf("t:%s c:%s v:%d\n",
-                    //     libevdev_event_type_get_name(ie.type),
-                    //     libevdev_event_code_get_name(ie.type, ie.code),
-                    //     ie.value
-                    // );
-
-                    int check_combos = 0;
-                    int filter = 0;
-                    struct input_event aie = ie;
-
-                    if (ie.type == EV_REL && ie.code == REL_WHEEL) {
-                        if (ie.value > 0) { aie.type = EV_KEY; aie.code = 0x400; aie.value = 1; };
-                        if (ie.value < 0) { aie.type = EV_KEY; aie.code = 0x402; aie.value = 1; };
-                    }
-                    if (ie.type == EV_REL && ie.code == REL_HWHEEL) {
-                        if (ie.value > 0) { aie.type = EV_KEY; aie.code = 0x401; aie.value = 1; };
-                        if (ie.value < 0) { aie.type = EV_KEY; aie.code = 0x403; aie.value = 1; };
-                    }
-
-                    if (aie.type == EV_KEY && aie.value < 2) {
-                        if (aie.value) {
-                            // Key pressed
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                                if (!active_keys[k] || active_keys[k] == aie.code) {
-                                    active_keys[k] = aie.code;
-                                    check_combos = 1;
-                                    break;
-                                };
-                            }
-                        }
-                        else {
-                            // Key released
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                                if (active_keys[k] == aie.code) active_keys[k] = 0;
-                            }
-                            if (dev->filter_release_code == aie.code) {
-                                filter = 1;
-                                dev->filter_release_code = 0;
-                            }
-                        }
-                    }
-
-                    // printf("\nActive keys: ");
-                    // for (int k = 0; k < EM_MAX_COMBO; k++) {
-                    //     if (active_keys[k])
-                    //         printf("%s ", em_event_code_get_name(active_keys[k]));
-                    // }
-
-                    if (check_combos) {
-
-                        // Check mapping combos
-                        em_mapping *mapping = mappings;
-                        while (mapping) {
-                            // If only_device is set, check if we need to ignore this mapping.
-                            if (mapping->only_device && mapping->only_device != (dev->idx+1))
-                                goto NEXT_MAPPING;
-
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                                if (active_keys[k] && !check_combo_array(mapping->combo, active_keys[k]))
-                                    goto NEXT_MAPPING;
-                            }
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                                if (mapping->combo[k] && !check_combo_array(active_keys, mapping->combo[k]))
-                                    goto NEXT_MAPPING;
-                            }
-
-                            // Mark to send output event sequence
-                            mapping->send_output = 1;
-                            if (mapping->filter_last) filter = 1;
-
-                            NEXT_MAPPING:
-                            mapping = mapping->next;
-                        }
-
-                        // Check client combos
-                        em_client *client = clients;
-                        while (client) {
-
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                                if (active_keys[k] && !check_combo_array(client->combo, active_keys[k]))
-                                    goto NEXT_CLIENT;
-                            }
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                                if (client->combo[k] && !check_combo_array(active_keys, client->combo[k]))
-                                    goto NEXT_CLIENT;
-                            }
-
-                            // Switch clients
-                            switch_client = client;
-                            filter = 1; // Always filter switch combos
-
-                            NEXT_CLIENT:
-                            client = client->next;
-                        }
-                    }
-
-                    // Forward event to output if we don't want it filtered
-                    if (filter) {
-                        // When filtering keypress ...
-                        if (ie.value > 0) {
-                            // ... remember to filter the release as well.
-                            dev->filter_release_code = ie.code;
-                            // ... remove filtered keypress from active_keys
-                            for (int k = 0; k < EM_MAX_COMBO; k++) {
-                               if (active_keys[k] >= ie.code) active_keys[k] = 0;
-                            }
-                        }
-                    }
-                    else {
-                        if (!send_event(active_client, dev, ie.type, ie.code, ie.value)) {
-                            // Something wrong with the device
-                            dev->active = 0;
-                            goto NEXT_GRAB;
-                        }
+                    // Collect a frame, it goes through the stages at its end.
+                    dev_frame.events[dev_frame.num++] = ie;
+                    if ((ie.type == EV_SYN && ie.code == SYN_REPORT) || dev_frame.num == EM_FRAME_READ) {
+                        if (!pipeline_run(dev)) goto NEXT_GRAB;
                     }
                 }
 
-                NEXT_DEV:
-                dev = dev->next;
+                // What was read of a frame that isn't complete yet
+                if (dev_frame.num && !pipeline_run(dev)) goto NEXT_GRAB;
             }
 
             // Remove fake keys from active_keys, they have no release event.
@@ -534,56 +2206,52 @@ int main(int argc, char* argv[]) {
             }
 
             // Send pending output sequences
-            em_mapping *mapping = mappings;
-            while (mapping) {
+            SEND_OUTPUT:
+            for (int m = 0; m < config->num_mappings; m++) {
+                em_mapping *mapping = &config->mappings[m];
                 if (mapping->send_output) {
-                    em_client *which_client = active_client;
-
-                    if (mapping->always_client) {
-                        em_client *c = em_client_by_idx(clients, mapping->always_client - 1);
-                        if (c) which_client = c;
-                    }
+                    em_client *which_client = mapping_client(mapping);
 
                     if (mapping->release_pressed) release_pressed(which_client);
-                    for (int k = 0; k < EM_MAX_OUTPUT_EVENTS; k++) {
-                        if (!mapping->output[k]) break;
-                        if (mapping->output[k]->code >= 0x400) {
-                            switch (mapping->output[k]->code) {
-                                case 0x400:
-                                    send_event(which_client, NULL, EV_REL, REL_WHEEL, 1);
-                                break;
-                                case 0x401:
-                                    send_event(which_client, NULL, EV_REL, REL_HWHEEL, 1);
-                                break;
-                                case 0x402:
-                                    send_event(which_client, NULL, EV_REL, REL_WHEEL, -1);
-                                break;
-                                case 0x403:
-                                    send_event(which_client, NULL, EV_REL, REL_HWHEEL, -1);
-                                break;
-                            }
-                        }
-                        else send_event(which_client, NULL, mapping->output[k]->type, mapping->output[k]->code, mapping->output[k]->value);
+                    if (mapping->macro) macro_start(which_client, mapping);
+                    else {
+                        for (int k = 0; k < mapping->num_output; k++)
+                            send_step(which_client, &mapping->output[k]);
+                        send_event(which_client, NULL, EV_SYN, SYN_REPORT, 0);
                     }
-                    send_event(which_client, NULL, EV_SYN, SYN_REPORT, 0);
                     mapping->send_output = 0;
                 }
-
-                mapping = mapping->next;
             }
 
             // Switch clients, if requested
             if (switch_client) {
                 if (switch_client != active_client) {
-                    release_pressed(active_client);
-                    printf("Switching to client #%u\n", switch_client->idx);
-                    active_client = switch_client;
+                    if (config->presence_fallback && switch_client->presence && !switch_client->present)
+                        printf("Client #%u: not present, staying on client #%u\n", switch_client->idx, active_client->idx);
+                    else switch_to(switch_client);
                 }
                 switch_client = NULL;
             }
 
+            // Reload configuration on SIGHUP
+            if (em_reload_requested) {
+                em_reload_requested = 0;
+                if (reload_config()) goto NEXT_GRAB;
+            }
+
+            if (em_status_requested) {
+                em_status_requested = 0;
+                dump_status();
+            }
+
+            if (em_trace_requested) {
+                em_trace_requested = 0;
+                em_trace(EM_TRACE_MARK, -1, active_client->idx, 0, EM_TRACE_MARK_DUMP, 0, 0);
+                if (em_trace_dump() == 0) printf("Trace written to %s\n", em_trace_file());
+                else printf("Error: Unable to write trace to %s\n", em_trace_file());
+            }
+
             // Check for device availability every ~3-4 seconds
-            NEXT_POLL:
             if (last_device_check < (time(NULL) - 3)) break;
         }
     }
@@ -1,23 +1,167 @@
 #ifndef __EM_H
 #define __EM_H
 
+#include <poll.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
+#include "octopus-trace.h"
+#include "octopus-stage.h"
+
+// Defaults for the "transport" config section
 #define EM_MULTICAST_GROUP "239.255.77.88"
 #define EM_MULTICAST_PORT  4020
+#define EM_MULTICAST_TTL   1
 #define EM_MAX_UDP_SIZE 64
 
-#define EM_MAX_CLIENTS 9
-#define EM_MAX_DEVICES  9
-#define EM_MAX_MAPPINGS 99
+// Clients announce themselves on the next port up.
+#define EM_TYPE_PRESENCE 0xfe00
+#define EM_DEFAULT_PRESENCE_TIMEOUT_MS 3000
+
+// clientIdx is a single byte on the wire. The top of the range addresses
+// groups: one datagram, encrypted with the group key, for all members.
+#define EM_MAX_CLIENTS 224
+#define EM_GROUP_BASE  EM_MAX_CLIENTS
+#define EM_MAX_GROUPS  32
 
 #define EM_MAX_STR 500
 #define EM_INPUT_DEV_DIR "/sys/class/input"
 #define EM_INPUT_DEV_PREFIX "event"
 
+// Event nodes grabbed per configured device, at most "nodes": N. Every
+// entry has a device of its own, numbered like the entries, devices for
+// further nodes are added as those show up, see em_add_node().
+#define EM_MAX_NODES 16
+#define EM_MAX_DEVICES 256
+
 #define EM_MAX_COMBO 4
-#define EM_MAX_OUTPUT_EVENTS 64
+#define EM_HELD_BYTES ((KEY_CNT + 7) / 8)
+#define EM_MAX_SEQUENCE 8
+#define EM_DEFAULT_SEQUENCE_MS 1000
+#define EM_MAX_REPEAT 1000
+
+#define EM_TIMER_SLOTS 256
+
+// Events dropped on the way in from a device or out to a client,
+// "drop_events": [ "EV_MSC", "KEY_CAPSLOCK", ... ]. Whole types, or
+// single codes of a type.
+#define EM_FILTER_BYTES (KEY_CNT / 8)   // Largest code range of all types
+
+typedef struct em_filter_type {
+    uint32_t            types;          // Bit per EV_* type
+    uint8_t            *codes[EV_CNT];  // Code bitmaps, NULL for types without
+} em_filter;
+
+typedef struct em_timer_type em_timer;
+typedef struct em_timer_type {
+    uint64_t            expires;
+    void              (*cb)(em_timer *timer);
+    void               *data;
+
+    int                 armed;
+    int                 slot;
+    em_timer           *next;
+    em_timer           *prev;
+} em_timer;
+
+// Event processing stages, see stages.c and octopus-stage.h. Frames are
+// read up to EM_FRAME_READ events, stages may grow them to EM_FRAME_EVENTS.
+#define EM_MAX_STAGES   16
+#define EM_FRAME_READ   128
+#define EM_FRAME_EVENTS 256
+
+typedef struct em_stage_type em_stage;
+typedef struct em_stage_type {
+    char                       *name;
+    char                       *plugin;     // Shared object, NULL for built-in stages
+    char                       *args;       // "args" as JSON text
+
+    void                       *handle;
+    const octopus_stage_ops    *ops;
+    void                       *state;
+    void                      (*run)(em_stage *stage, octopus_frame *frame); // Built-in stages
+
+    // Cost, measured around every frame the stage sees
+    uint64_t                    frames;
+    uint64_t                    events;
+    uint64_t                    total_ns;
+    uint64_t                    max_ns;
+} em_stage;
+
+// Timed mapping states
+#define EM_TIMED_IDLE    0
+#define EM_TIMED_PENDING 1
+#define EM_TIMED_HOLDING 2
+
+// Payload extensions follow the 12 byte event, inside the encryption.
+#define EM_EXT_KEYLOG 1
+#define EM_MAX_REDUNDANCY 8
+
+struct __attribute__((__packed__)) em_ext_header {
+    uint8_t                 type;
+    uint8_t                 len;        // Including this header
+    uint16_t                seq;        // EM_EXT_KEYLOG: key sequence of the event, 0 if none
+};
+
+// EM_EXT_KEYLOG entries, oldest first: the key transitions sent before.
+struct __attribute__((__packed__)) em_keylog_entry {
+    uint16_t                seq;
+    uint16_t                code;
+    uint8_t                 value;
+};
+
+// Packets waiting for the socket, see send-queue.c. Per client, for its
+// key and motion queues together.
+#define EM_QUEUE_LEN 32
+
+typedef struct em_queued_type {
+    size_t                  len;        // As passed to send_remote_packet()
+    uint8_t                 buf[EM_MAX_UDP_SIZE];
+} em_queued;
+
+typedef struct em_queue_type {
+    em_queued               items[EM_QUEUE_LEN];
+    int                     head;
+    int                     num;
+} em_queue;
+
+// Shared memory ring for clients on this host, see shm-ring.c. The
+// layout is duplicated in octopus-client.
+#define EM_SHM_MAGIC 0x314d4853 // "SHM1"
+#define EM_SHM_SLOTS 1024       // Power of two
+#define EM_SHM_CLIENTS 16       // Attached at a time, per ring
+#define EM_SHM_POLLFDS (EM_SHM_CLIENTS + 1)  // Listening socket and connections
+
+typedef struct em_shm_slot_type {
+    uint64_t                seq;        // 0 while written, index + 1 when done
+    uint16_t                len;        // Packet size, as it would be sent
+    uint8_t                 buf[EM_MAX_UDP_SIZE];
+} em_shm_slot;
+
+typedef struct em_shm_ring_type {
+    uint32_t                magic;
+    uint32_t                slots;
+    uint64_t                head;       // Packets published so far
+    em_shm_slot             slot[EM_SHM_SLOTS];
+} em_shm_ring;
+
+typedef struct em_shm_type {
+    char                   *path;
+    int                     listenfd;
+    int                     memfd;
+    int                     rofd;       // memfd reopened read-only, what clients get
+    // A doorbell eventfd per attached client, rung once per frame. With
+    // a shared one, whoever reads first takes everyone's rings. The
+    // connections are kept to notice clients going away.
+    int                     bellfds[EM_SHM_CLIENTS];
+    int                     connfds[EM_SHM_CLIENTS];
+    int                     num_attached;
+    em_shm_ring            *ring;
+    uint64_t                head;
+    int                     pollfd_idx;
+} em_shm;
+
+typedef struct em_mapping_type em_mapping;
 
 typedef struct em_client_type em_client;
 typedef struct em_client_type {
@@ -26,34 +170,155 @@ typedef struct em_client_type {
 
     int                 local;
     char               *key;
+    uint16_t           *keymap;         // KEY_CNT entries, translates what the client is sent
+    em_filter           filter;         // Events the client isn't sent
+
+    // Shared memory instead of multicast, "shm": "<socket path>". The
+    // ring outlives config reloads as long as the path stays.
+    char               *shm_path;
+    em_shm             *shm;
+
+    // Member of config->groups[g] if bit g is set. Groups themselves are
+    // em_clients with idx EM_GROUP_BASE + g and a name.
+    uint32_t            groups;
+    char               *name;
+
+    // Presence tracking, only for clients with "presence": true
+    int                 presence;
+    int                 present;
+    uint64_t            last_seen;
 
-    em_client          *next;
+    // Last key transitions, repeated in every packet with "redundancy": N
+    int                 redundancy;
+    uint16_t            key_seq;
+    int                 keylog_num;
+    struct em_keylog_entry keylog[EM_MAX_REDUNDANCY];
+
+    // Keys and buttons sent as pressed and not yet released, one bit per
+    // code. Released in one frame when switching away.
+    uint8_t             held[EM_HELD_BYTES];
+    int                 num_held;
+
+    // Macro being played back to this client, one at a time
+    em_mapping         *macro;
+    int                 macro_step;
+    int                 macro_round;
+    em_timer            macro_timer;
+
+    // Set once an event went out after the last SYN_REPORT, mirrored
+    // devices aside. Frames left empty by filtering aren't sent.
+    int                 frame_open;
+
+    // Output backlog, keys and control packets go ahead of motion.
+    em_queue            out_keys;
+    em_queue            out_motion;
+    int                 frame_keys;     // Key events sent since the last SYN_REPORT
+    int                 frame_motion;   // Motion queued since the last SYN_REPORT
+    uint32_t            out_queued;     // Counters shown on SIGUSR1
+    uint32_t            out_merged;
+    uint32_t            out_dropped;
+    uint32_t            out_errors;
+    uint32_t            out_keys_dropped;   // New key packets dropped, see queue_packet()
 } em_client;
 
-typedef struct em_mapping_type em_mapping;
+typedef struct em_device_type em_device;
+
+// One step of a mapping's output
+typedef struct em_step_type {
+    uint16_t            type;
+    uint16_t            code;
+    int32_t             value;
+    int                 delay_ms;       // Pause after this step
+} em_step;
+
 typedef struct em_mapping_type {
     int                 combo[EM_MAX_COMBO];
-    struct input_event *output[EM_MAX_OUTPUT_EVENTS];
+    em_step            *output;         // Points into em_config.outputs
+    int                 num_output;
+
+    // Macros: outputs with pauses or repeats are played back from the
+    // timer wheel instead of in one burst, see macro_play().
+    int                 macro;
+    int                 step_ms;        // Pause after every step
+    int                 repeat;
+
     int                 filter_last;
     int                 release_pressed;
     int                 always_client;
+    int                 always_group;   // Group number + 1
     int                 only_device;
 
+    // Timed mappings. Tap/hold mappings have a single key combo, sequence
+    // mappings fire once all keys in sequence[] were pressed in order.
+    int                 tap_ms;
+    int                 hold_ms;
+    int                 hold_code;
+    int                 sequence[EM_MAX_SEQUENCE];
+    int                 sequence_ms;
+
     int                 send_output;
 
-    em_mapping         *next;
+    // Tap/hold decision state
+    int                 timed_state;
+    uint64_t            timed_since;
+    em_timer            timer;
+    em_client          *timed_client;
+    em_device          *timed_dev;
 } em_mapping;
 
-typedef struct em_device_type em_device;
-typedef struct em_device_type {
+// Per axis processing of absolute events
+typedef struct em_axis_type {
     // Filled by jsmn_cfg_parse()
-    int                     idx;
+    int                     deadband;   // Values this close to the center snap to it
+    int                     quantize;   // Round to multiples of this, off the center
+
+    // Last value forwarded, unchanged values are dropped.
+    int                     has_last;
+    int                     last;
+} em_axis;
+
+// Multitouch (protocol B) axes, ABS_MT_SLOT itself excluded
+#define EM_MT_FIRST     ABS_MT_TOUCH_MAJOR
+#define EM_MT_LAST      ABS_MT_TOOL_Y
+#define EM_MT_AXES      (EM_MT_LAST - EM_MT_FIRST + 1)
+#define EM_MAX_MT_SLOTS 16
+
+// State of one touch slot as last seen on the device
+typedef struct em_mt_slot_type {
+    int32_t                 value[EM_MT_AXES];
+    uint16_t                changed;    // Axis bits not yet sent to the client
+} em_mt_slot;
+
+typedef struct em_clone_type em_clone;
+typedef struct em_clone_type {
+    // Pool key
     uint16_t                product_id;
     uint16_t                vendor_id;
     char                   *name;
+    uint32_t                caps;
+
+    int                     bound;
+    int                     uifd;
+    struct libevdev_uinput *uidev;
+    em_clone               *next;
+} em_clone;
+
+// Device data only needed when (re)grabbing devices.
+typedef struct em_device_info_type {
+    // Filled by jsmn_cfg_parse(). IDs are four lowercase hex digits, IDs
+    // and name may contain fnmatch() wildcards.
+    char                   *vendor_id;
+    char                   *product_id;
+    char                   *name;
     char                   *check_capability;
-    em_device              *next;
+    int                     nodes;      // Most event nodes grabbed for the entry
 
+    // Filled by em_grab_devices()
+    char                    device[32];
+} em_device_info;
+
+// Device data used in the event loop.
+typedef struct em_device_type {
     // Active state
     int                     active;
     int                     pollfd_idx;
@@ -61,15 +326,158 @@ typedef struct em_device_type {
     // Filter KEY/BTN release
     uint16_t                filter_release_code;
 
+    // Events dropped right after reading. Installed as the kernel's
+    // event mask too, see em_device_mask(), so they don't wake us up.
+    em_filter               filter;
+
+    // Exclusive access, see em_config.local_passthrough
+    int                     grabbed;
+    uint8_t                 injected[KEY_CNT / 8];  // Releases written by em_device_grab(), not yet read back
+
+    // Devices with absolute axes and "mirror": true are mirrored on
+    // remote clients, their events go out as EM_SLOT_TYPE(idx, type).
+    // 0 for other devices, their events go out with plain types.
+    int                     mirror;
+    uint16_t                slot_type;
+    int                     frame_events;   // Events forwarded since the last SYN_REPORT
+    em_axis                *axes;           // ABS_CNT entries
+
+    // Touchpads: slot state, remote clients only get what changed.
+    em_mt_slot             *mt;             // EM_MAX_MT_SLOTS entries
+    int                     mt_slots;       // Slots in use, 0 if not multitouch
+    int                     mt_slot;        // Current slot
+
     // Filled by em_grab_devices()
-    char                   *device;
     int                     evfd;
     struct libevdev        *evdev;
-    int                     uifd;
     struct libevdev_uinput *uidev;
+    em_clone               *clone;
+
+    // Filled by jsmn_cfg_parse() for the entry's first event node, by
+    // em_add_node() for the others. Each device grabs one matching node.
+    int                     idx;
+    int                     entry;      // Config entry, as counted by only_device
+    int                     node;       // Position within the entry
+    em_device              *next_node;  // Device of the entry's next node
+    em_device_info         *info;
 } em_device;
 
 
+// One parsed configuration, swapped as a whole on reload. All tables are
+// dense arrays sized from the config file and live in a single arena
+// allocation together with this struct and the config strings.
+// Where events go. Only applied at startup.
+typedef struct em_transport_type {
+    char                   *group;      // IPv4 or IPv6 multicast group
+    int                     port;
+    char                   *interface;  // Egress interface name or IPv4 address, NULL to route
+    int                     ttl;        // Multicast hops
+    int                     loopback;   // Also deliver to this host
+    int                     sndbuf;     // Socket buffer sizes, 0 for the system default
+    int                     rcvbuf;
+} em_transport;
+
+typedef struct em_config_type {
+    em_device              *devices;
+    em_device_info         *device_info;
+    int                     num_devices;    // Entries, then the nodes added since
+    int                     max_devices;    // Size of devices[]
+
+    em_mapping             *mappings;
+    em_step                *outputs;
+    int                     num_mappings;
+
+    em_client              *clients;
+    int                     num_clients;
+    em_client              *groups;     // Follow the clients in the same array
+    int                     num_groups;
+
+    em_transport            transport;
+
+    int                     presence_timeout_ms;
+    int                     presence_fallback;
+
+    // Ungrab devices while a local client is active, so their events go
+    // to the desktop directly instead of through the uinput clones. Combos
+    // are still detected, but can't be filtered: the desktop sees switch
+    // combos and mapping keys as well.
+    int                     local_passthrough;
+
+    char                   *trace_file;
+
+    // Plugin stages in config order, "stages": [ { "plugin": ... } ]
+    em_stage               *stages;
+    int                     num_stages;
+} em_config;
+
+
+// Events from mirrored devices carry the device slot in the high byte
+// of their type, slot 0 being the client's own output device. High bytes
+// 0xfe and 0xff are control types (EM_TYPE_PRESENCE, ...), so slots end
+// at 0xfd.
+#define EM_SLOT_TYPE(idx, type) ((((idx) + 1) << 8) | (type))
+#define EM_MAX_SLOTS 253
+
+// Device descriptors for mirrored devices. Sent as an event with type
+// EM_TYPE_DEVICE, the device index as code and one of EM_DEV_* as value,
+// the data itself in an EM_EXT_DEVICE extension. A descriptor is INFO,
+// any number of BITS/ABS/PROPS and a COMMIT counting all of them.
+#define EM_TYPE_DEVICE 0xfe01
+#define EM_EXT_DEVICE  2
+
+#define EM_DEV_INFO    1
+#define EM_DEV_BITS    2
+#define EM_DEV_ABS     3
+#define EM_DEV_PROPS   4
+#define EM_DEV_COMMIT  5
+
+struct __attribute__((__packed__)) em_dev_info {
+    uint16_t                vendor;
+    uint16_t                product;
+    uint16_t                version;
+    char                    name[32];
+};
+
+// Supported codes 256 * chunk to 256 * chunk + 255 of an event type
+struct __attribute__((__packed__)) em_dev_bits {
+    uint8_t                 type;
+    uint8_t                 chunk;
+    uint32_t                bits[8];
+};
+
+struct __attribute__((__packed__)) em_dev_abs {
+    uint16_t                code;
+     int32_t                minimum;
+     int32_t                maximum;
+     int32_t                fuzz;
+     int32_t                flat;
+     int32_t                resolution;
+};
+
+struct __attribute__((__packed__)) em_dev_props {
+    uint32_t                bits;
+};
+
+struct __attribute__((__packed__)) em_dev_commit {
+    uint16_t                num;        // Messages in this descriptor, including INFO and COMMIT
+    uint32_t                caps;       // Capability hash, unchanged devices aren't recreated
+};
+
+// Changed multitouch fields of one frame, sent as an event with type
+// EM_TYPE_MTFRAME and the device index as code ahead of the SYN_REPORT
+// ending the frame. Frames with more changes are split over packets.
+#define EM_TYPE_MTFRAME 0xfe02
+#define EM_EXT_MTFRAME  3
+#define EM_MT_ENTRIES   8
+
+struct __attribute__((__packed__)) em_mt_entry {
+    uint8_t                 slot_axis;  // Slot << 4 | code - EM_MT_FIRST
+     int32_t                value;
+};
+
+// Low bits of em_packet.rnd holding the sender's ms clock
+#define EM_STAMP_MASK 0xffff
+
 #define EM_ENC_CLEAR_LEN 12
 #define EM_ENC_ENC_LEN   16
 #define EM_CLEAR_PACKET_LEN (EM_ENC_CLEAR_LEN + 2)
@@ -85,14 +493,73 @@ struct __attribute__((__packed__)) em_packet {
      int32_t                value;      // 4
     // Extra bytes for encryption
     uint32_t                _space_;    // 4
-} em_packet;
+};
 
 void      em_usage();
 void      em_fatal(const char* format, ...);
 void*     em_malloc(int size);
 int       em_event_code_from_name(const char *name);
+int       em_event_type_from_code_name(const char *name);
 const char * em_event_code_get_name(unsigned int code);
 
-void      jsmn_cfg_parse(char *, em_device **, em_mapping **, em_client **em_client);
+uint64_t  em_now_ms();
+void      em_timer_arm(em_timer *timer, uint64_t expires);
+void      em_timer_cancel(em_timer *timer);
+int       em_timer_timeout(int max_ms);
+void      em_timer_run();
+
+em_clone *em_clone_acquire(struct libevdev *evdev);
+void      em_clone_release(em_clone *clone, struct libevdev *evdev);
+void      em_clone_create_all(struct libevdev **evdevs, char **names, em_clone **clones, int num);
+void      em_clone_prune(em_config *config);
+
+extern em_trace_rec em_trace_ring[EM_TRACE_RECORDS];
+extern uint64_t     em_trace_total;
+extern uint64_t     em_trace_now;
+
+uint64_t  em_trace_clock();
+void      em_trace_set_file(const char *path);
+const char *em_trace_file();
+int       em_trace_dump();
+
+static inline void em_trace(uint8_t kind, int dev, int client, uint16_t type, uint16_t code, int32_t value, int32_t aux) {
+    em_trace_rec *rec = &em_trace_ring[em_trace_total++ & (EM_TRACE_RECORDS - 1)];
+    rec->time_us = em_trace_now;
+    rec->value   = value;
+    rec->aux     = aux;
+    rec->type    = type;
+    rec->code    = code;
+    rec->kind    = kind;
+    rec->dev     = dev < 0 ? EM_TRACE_NO_DEV : dev;
+    rec->client  = client < 0 ? EM_TRACE_NO_CLIENT : client;
+}
+
+static inline int em_filter_drops(em_filter *filter, uint16_t type, uint16_t code) {
+    if (type >= EV_CNT) return 0;
+    if (filter->types & (1u << type)) return 1;
+    uint8_t *codes = filter->codes[type];
+    return codes && code < KEY_CNT && (codes[code >> 3] & (1 << (code & 7)));
+}
+
+int       em_is_motion(uint16_t type);
+em_queued *em_queue_push(em_queue *queue, uint8_t *buf, size_t len);
+em_queued *em_queue_peek(em_queue *queue);
+void      em_queue_pop(em_queue *queue);
+int       em_queue_merge(em_queue *queue, uint16_t type, uint16_t code, int32_t value);
+int       em_queue_drop_repeat(em_queue *queue, struct em_packet *removed);
+
+void      em_stages_open(em_config *config);
+void      em_stages_close(em_config *config);
+void      em_stage_run(em_stage *stage, octopus_frame *frame);
+
+em_shm   *em_shm_open(const char *path);
+void      em_shm_pollfds(em_shm *shm, struct pollfd *pfds);
+void      em_shm_serve(em_shm *shm, struct pollfd *pfds);
+void      em_shm_push(em_shm *shm, uint8_t *buf, size_t size, int bell);
+void      em_shm_close(em_shm *shm);
+
+em_config *jsmn_cfg_parse(char *fname);
+void      jsmn_cfg_abort();
+void      em_config_free(em_config *config);
 
 #endif
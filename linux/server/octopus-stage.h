@@ -0,0 +1,51 @@
+#ifndef __OCTOPUS_STAGE_H
+#define __OCTOPUS_STAGE_H
+
+// Plugin interface for event processing stages. A plugin is a shared
+// object listed under "stages" in the server config. It exports
+// octopus_stage(), returning a table of its functions. Only this header
+// is shared with the server, so a plugin keeps working across server
+// versions as long as OCTOPUS_STAGE_ABI stays the same. Structs only
+// ever grow at the end.
+//
+// Events are read from a device one frame at a time, a frame ending with
+// its SYN_REPORT. The frame goes through the built-in "drop" stage (the
+// device's "drop_events"), then through the plugin stages in config order,
+// then to the built-in "route" stage: timed mappings, combos, client
+// switching and sending.
+
+#include <stdint.h>
+#include <linux/input.h>
+
+#define OCTOPUS_STAGE_ABI    1
+#define OCTOPUS_STAGE_SYMBOL "octopus_stage"
+
+// The events of one frame, shared by all stages. Stages work on it in
+// place: change events, drop some by moving the rest down and lowering
+// num, or add some. events has room for max events and max is a hard
+// limit, writing past it corrupts the server.
+typedef struct octopus_frame {
+    struct input_event *events;
+    uint32_t            num;
+    uint32_t            max;
+    uint32_t            device;     // Config entry of the device, from 1 as "only_device"
+    uint32_t            node;       // Event node within the entry, from 0
+    int32_t             client;     // Client to send to as numbered in the config, -1 for the active one
+} octopus_frame;
+
+typedef struct octopus_stage_ops {
+    uint32_t            abi;        // OCTOPUS_STAGE_ABI
+    const char         *name;       // Default for the stage entry's "name"
+
+    // Called on (re)loading the config, args is the entry's "args" as
+    // JSON text, empty without. Returns 0 and sets *state on success.
+    int               (*init)(const char *args, void **state);
+    void              (*process)(void *state, octopus_frame *frame);
+    void              (*destroy)(void *state);
+} octopus_stage_ops;
+
+typedef const octopus_stage_ops *(*octopus_stage_fn)(void);
+
+const octopus_stage_ops *octopus_stage(void);
+
+#endif
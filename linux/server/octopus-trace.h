@@ -0,0 +1,65 @@
+#ifndef __EM_TRACE_H
+#define __EM_TRACE_H
+
+#include <stdint.h>
+
+// Flight recorder. The server keeps the last EM_TRACE_RECORDS steps of
+// its event pipeline in a ring and writes them to a file on SIGUSR2 or
+// when it dies. octopus-trace decodes the file.
+
+#define EM_TRACE_RECORDS 16384 // Power of two
+#define EM_TRACE_MAGIC   "OCTOTRC1"
+#define EM_TRACE_FILE    "/var/tmp/octopus-server.trace"
+
+// Record kinds
+#define EM_TRACE_EVENT   1  // Event read from device, time is the kernel timestamp
+#define EM_TRACE_TIMED   2  // Event consumed by a tap/hold or sequence mapping
+#define EM_TRACE_FILTER  3  // Event filtered, see EM_TRACE_FILTER_*
+#define EM_TRACE_MAPPING 4  // Mapping fired, aux is the mapping index
+#define EM_TRACE_SWITCH  5  // Client switch, aux is the previous client
+#define EM_TRACE_SEND    6  // Event sent to client, aux is the result
+#define EM_TRACE_DROP    7  // Event not sent, see EM_TRACE_DROP_*
+#define EM_TRACE_ERROR   8  // Sending failed, aux is the error
+#define EM_TRACE_MARK    9  // Pipeline event, code is one of EM_TRACE_MARK_*
+
+#define EM_TRACE_MARK_GRAB    1
+#define EM_TRACE_MARK_RELOAD  2
+#define EM_TRACE_MARK_FATAL   3
+#define EM_TRACE_MARK_DUMP    4
+#define EM_TRACE_MARK_RELEASE 5 // Held keys released on switching, aux is their number
+
+// aux of EM_TRACE_FILTER records
+#define EM_TRACE_FILTER_COMBO    0 // Switch combo, mapping with filter_last, or the release of either
+#define EM_TRACE_FILTER_DEVICE   1 // In the device's "drop_events"
+#define EM_TRACE_FILTER_CLIENT   2 // In the client's "drop_events", code is after the keymap
+#define EM_TRACE_FILTER_INJECTED 3 // Key release the server wrote to the device itself when grabbing
+
+// aux of EM_TRACE_DROP records
+#define EM_TRACE_DROP_ABSENT   0 // Client absent
+#define EM_TRACE_DROP_OVERFLOW 1 // Send queue full
+#define EM_TRACE_DROP_EMPTY    2 // SYN_REPORT of a frame left empty by filtering
+
+#define EM_TRACE_NO_DEV    0xffff
+#define EM_TRACE_NO_CLIENT 0xff
+
+typedef struct em_trace_rec_type {
+    uint64_t                time_us;    // CLOCK_MONOTONIC
+     int32_t                value;
+     int32_t                aux;
+    uint16_t                type;
+    uint16_t                code;
+    uint16_t                dev;
+    uint8_t                 client;
+    uint8_t                 kind;
+} em_trace_rec;
+
+// File layout: this header, then 'num' records, oldest first.
+typedef struct em_trace_header_type {
+    char                    magic[8];
+    uint32_t                rec_size;
+    uint32_t                num;
+    uint64_t                total;      // Records written since start
+    uint64_t                dumped_us;
+} em_trace_header;
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "octopus-server.h"
+
+// Bounded per-client output queues. Packets only end up here when the
+// socket pushes back, they are stored before encryption so motion can
+// still be merged while it waits. Key and control packets go into a
+// separate queue that is drained first. Both queues of a client share
+// EM_QUEUE_LEN packets, see queue_packet().
+
+// Packets that may be merged or dropped when the link can't keep up.
+// Touch frames aren't: every change in them is only sent once.
+int em_is_motion(uint16_t type) {
+    if (type >= EM_TYPE_PRESENCE) return 0;
+    return (type & 0xff) == EV_REL || (type & 0xff) == EV_ABS;
+}
+
+// Append a packet, NULL if the queue is full.
+em_queued *em_queue_push(em_queue *queue, uint8_t *buf, size_t len) {
+    if (queue->num == EM_QUEUE_LEN) return NULL;
+    em_queued *item = &queue->items[(queue->head + queue->num) % EM_QUEUE_LEN];
+    queue->num++;
+    memcpy(item->buf, buf, len + 2);
+    item->len = len;
+    return item;
+}
+
+em_queued *em_queue_peek(em_queue *queue) {
+    return queue->num ? &queue->items[queue->head] : NULL;
+}
+
+void em_queue_pop(em_queue *queue) {
+    if (!queue->num) return;
+    queue->head = (queue->head + 1) % EM_QUEUE_LEN;
+    queue->num--;
+}
+
+// Fold a motion event into one still waiting: relative motion adds up,
+// absolute axes only need the latest value. Returns 1 if merged.
+int em_queue_merge(em_queue *queue, uint16_t type, uint16_t code, int32_t value) {
+    if ((type & 0xff) != EV_REL && (type & 0xff) != EV_ABS) return 0;
+
+    // Newest first, merging into the latest frame moves motion the least.
+    for (int i = queue->num - 1; i >= 0; i--) {
+        struct em_packet *packet = (struct em_packet *)queue->items[(queue->head + i) % EM_QUEUE_LEN].buf;
+        if (packet->type != type || packet->code != code) continue;
+        if ((type & 0xff) == EV_REL) packet->value += value;
+        else packet->value = value;
+        return 1;
+    }
+    return 0;
+}
+
+// Key repeats only say a key is still down, they can go when the queues
+// are full. Removes the oldest one, copying it to *removed. Returns 0 if
+// there is none.
+int em_queue_drop_repeat(em_queue *queue, struct em_packet *removed) {
+    for (int i = 0; i < queue->num; i++) {
+        struct em_packet *packet = (struct em_packet *)queue->items[(queue->head + i) % EM_QUEUE_LEN].buf;
+        if (packet->type >= EM_TYPE_PRESENCE || (packet->type & 0xff) != EV_KEY || packet->value != 2) continue;
+        *removed = *packet;
+        for (; i < queue->num - 1; i++)
+            queue->items[(queue->head + i) % EM_QUEUE_LEN] = queue->items[(queue->head + i + 1) % EM_QUEUE_LEN];
+        queue->num--;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
+
+#include "octopus-server.h"
+
+// Shared memory transport for clients on this host. Packets go into a
+// single producer ring in a memfd exactly as they would go on the wire,
+// unencrypted. A client connects to the unix socket at the configured
+// path and gets the memfd and an eventfd doorbell of its own back, rung
+// once per frame, and stays connected while attached. Nothing is ever
+// waited for: a client that falls a whole ring behind notices and skips
+// ahead.
+//
+// Each slot is a small seqlock, its seq is 0 while being written and
+// index + 1 afterwards, so readers can tell torn or overwritten slots.
+
+em_shm *em_shm_open(const char *path) {
+    em_shm *shm = em_malloc(sizeof(em_shm));
+    shm->path = strdup(path);
+    if (!shm->path) em_fatal("strdup() failed");
+
+    shm->memfd = memfd_create("octopus-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->memfd < 0) em_fatal("Unable to create shared memory for %s.", path);
+    if (ftruncate(shm->memfd, sizeof(em_shm_ring)) < 0)
+        em_fatal("Unable to size shared memory for %s.", path);
+
+    shm->ring = mmap(NULL, sizeof(em_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+    if (shm->ring == MAP_FAILED) em_fatal("Unable to map shared memory for %s.", path);
+
+    // Clients only read, and one client must not be able to forge input
+    // for the others: they get a read-only descriptor, and once our own
+    // mapping exists nobody can write or map the memfd writable again,
+    // not even by reopening it through /proc. It must not shrink under
+    // the clients' mappings either.
+    char fdpath[64];
+    snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", shm->memfd);
+    shm->rofd = open(fdpath, O_RDONLY | O_CLOEXEC);
+    if (shm->rofd < 0) em_fatal("Unable to reopen shared memory for %s read-only.", path);
+    if (fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0)
+        em_fatal("Unable to seal shared memory for %s.", path);
+    shm->ring->magic = EM_SHM_MAGIC;
+    shm->ring->slots = EM_SHM_SLOTS;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) em_fatal("Config: shm path '%s' too long.", path);
+    strcpy(addr.sun_path, path);
+
+    shm->listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (shm->listenfd < 0) em_fatal("Unable to open socket for %s.", path);
+    unlink(path);
+    if (bind(shm->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        em_fatal("Unable to bind socket to %s.", path);
+    // Whoever may connect gets the input stream.
+    chmod(path, 0660);
+    if (listen(shm->listenfd, 4) < 0) em_fatal("Unable to listen on %s.", path);
+
+    return shm;
+}
+
+// Forget client c, it closed its end of the connection.
+static void em_shm_detach(em_shm *shm, int c) {
+    close(shm->connfds[c]);
+    close(shm->bellfds[c]);
+    shm->num_attached--;
+    shm->connfds[c] = shm->connfds[shm->num_attached];
+    shm->bellfds[c] = shm->bellfds[shm->num_attached];
+    printf("Shared memory %s: client detached, %d left\n", shm->path, shm->num_attached);
+}
+
+// Hand the ring and a doorbell of its own to a connecting client. The
+// connection is kept open to tell when the client is gone.
+static void em_shm_accept(em_shm *shm) {
+    int conn = accept4(shm->listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) return;
+
+    if (shm->num_attached == EM_SHM_CLIENTS) {
+        printf("Shared memory %s: already %d clients attached\n", shm->path, EM_SHM_CLIENTS);
+        close(conn);
+        return;
+    }
+    int bellfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (bellfd < 0) {
+        printf("Shared memory %s: unable to create eventfd, errno %d\n", shm->path, errno);
+        close(conn);
+        return;
+    }
+
+    uint32_t info[2] = { EM_SHM_MAGIC, sizeof(em_shm_ring) };
+    struct iovec iov = { .iov_base = info, .iov_len = sizeof(info) };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { shm->rofd, bellfd };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) {
+        printf("Shared memory %s: handing out ring failed with errno %d\n", shm->path, errno);
+        close(bellfd);
+        close(conn);
+        return;
+    }
+    shm->connfds[shm->num_attached] = conn;
+    shm->bellfds[shm->num_attached] = bellfd;
+    shm->num_attached++;
+    printf("Shared memory %s: client attached, %d in total\n", shm->path, shm->num_attached);
+}
+
+// Fill the EM_SHM_POLLFDS pollfds at pfds: the listening socket, then
+// the connections of attached clients, -1 for unused entries. Clears
+// revents, clients sharing a ring only get it served once.
+void em_shm_pollfds(em_shm *shm, struct pollfd *pfds) {
+    pfds[0].fd      = shm->listenfd;
+    pfds[0].events  = POLLIN;
+    pfds[0].revents = 0;
+    for (int c = 0; c < EM_SHM_CLIENTS; c++) {
+        pfds[c + 1].fd      = c < shm->num_attached ? shm->connfds[c] : -1;
+        pfds[c + 1].events  = POLLRDHUP;
+        pfds[c + 1].revents = 0;
+    }
+}
+
+// Act on what poll() returned for em_shm_pollfds(): detach clients that
+// hung up, so their doorbells aren't rung any longer, and accept new ones.
+void em_shm_serve(em_shm *shm, struct pollfd *pfds) {
+    // Backwards, detaching moves the last client into the freed entry.
+    for (int c = shm->num_attached - 1; c >= 0; c--) {
+        if (pfds[c + 1].revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) em_shm_detach(shm, c);
+    }
+    if (pfds[0].revents & POLLIN) em_shm_accept(shm);
+    em_shm_pollfds(shm, pfds);
+}
+
+// Publish one packet of 'size' bytes, the two clear header bytes
+// included. Ringing the bell wakes the client for everything published
+// so far.
+void em_shm_push(em_shm *shm, uint8_t *buf, size_t size, int bell) {
+    em_shm_ring *ring = shm->ring;
+    em_shm_slot *slot = &ring->slot[shm->head & (EM_SHM_SLOTS - 1)];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot->buf, buf, size);
+    slot->len = size;
+    shm->head++;
+    __atomic_store_n(&slot->seq, shm->head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, shm->head, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    for (int c = 0; bell && c < shm->num_attached; c++) {
+        if (write(shm->bellfds[c], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            printf("Shared memory %s: doorbell failed with errno %d\n", shm->path, errno);
+    }
+}
+
+void em_shm_close(em_shm *shm) {
+    if (!shm) return;
+    close(shm->listenfd);
+    unlink(shm->path);
+    munmap(shm->ring, sizeof(em_shm_ring));
+    close(shm->memfd);
+    close(shm->rofd);
+    for (int c = 0; c < shm->num_attached; c++) {
+        close(shm->connfds[c]);
+        close(shm->bellfds[c]);
+    }
+    free(shm->path);
+    free(shm);
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "octopus-server.h"
+
+// Plugin stages. Every config loads its own instances, so a reload can
+// change a stage's args or swap the shared object underneath: the new
+// config's stages are set up before it's swapped in, the old ones are
+// destroyed after. dlopen() counts references, a plugin used by both
+// configs stays mapped.
+
+static void em_stage_unload(em_stage *stage) {
+    if (stage->ops && stage->ops->destroy) stage->ops->destroy(stage->state);
+    if (stage->handle) dlclose(stage->handle);
+    stage->ops    = NULL;
+    stage->state  = NULL;
+    stage->handle = NULL;
+}
+
+void em_stages_open(em_config *config) {
+    for (int s = 0; s < config->num_stages; s++) {
+        em_stage *stage = &config->stages[s];
+        char error[EM_MAX_STR+1];
+
+        stage->handle = dlopen(stage->plugin, RTLD_NOW | RTLD_LOCAL);
+        if (!stage->handle) {
+            snprintf(error, sizeof(error), "%s", dlerror());
+            goto FAILED;
+        }
+
+        octopus_stage_fn get_ops = (octopus_stage_fn)dlsym(stage->handle, OCTOPUS_STAGE_SYMBOL);
+        const octopus_stage_ops *ops = get_ops ? get_ops() : NULL;
+        if (!ops || !ops->process) {
+            snprintf(error, sizeof(error), "no %s() in %s", OCTOPUS_STAGE_SYMBOL, stage->plugin);
+            goto FAILED;
+        }
+        if (ops->abi != OCTOPUS_STAGE_ABI) {
+            snprintf(error, sizeof(error), "%s has plugin ABI %u, expected %u",
+                stage->plugin, ops->abi, OCTOPUS_STAGE_ABI);
+            goto FAILED;
+        }
+        if (!stage->name) stage->name = (char *)(ops->name ? ops->name : stage->plugin);
+        if (ops->init && ops->init(stage->args, &stage->state) != 0) {
+            snprintf(error, sizeof(error), "%s failed to initialize", stage->name);
+            goto FAILED;
+        }
+        stage->ops = ops;
+        printf("Stage #%d: %s from %s\n", s, stage->name, stage->plugin);
+        continue;
+
+        FAILED:
+        if (stage->handle) dlclose(stage->handle);
+        stage->handle = NULL;
+        for (int o = 0; o < s; o++) em_stage_unload(&config->stages[o]);
+        em_fatal("Stage #%d: %s", s, error);
+    }
+}
+
+void em_stages_close(em_config *config) {
+    for (int s = 0; s < config->num_stages; s++) em_stage_unload(&config->stages[s]);
+}
+
+static uint64_t em_stage_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs one stage over a frame and books the time it took.
+void em_stage_run(em_stage *stage, octopus_frame *frame) {
+    uint64_t start = em_stage_ns();
+    stage->events += frame->num;
+
+    if (stage->run) stage->run(stage, frame);
+    else stage->ops->process(stage->state, frame);
+
+    // Only an assertion: a stage that wrote past max has already
+    // corrupted memory, this just stops later stages from reading on.
+    if (frame->num > frame->max) em_fatal("Stage %s returned %u events, at most %u fit.",
+        stage->name, frame->num, frame->max);
+
+    uint64_t ns = em_stage_ns() - start;
+    stage->frames++;
+    stage->total_ns += ns;
+    if (ns > stage->max_ns) stage->max_ns = ns;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "octopus-server.h"
+
+// Hashed timer wheel with 1ms ticks, served from the main poll() loop.
+// Timers are embedded in the objects that own them, arming and cancelling
+// is O(1) and nothing is ever allocated. Timers further away than one
+// revolution simply stay in their slot until their round comes up.
+
+static em_timer *em_timer_slots[EM_TIMER_SLOTS];
+static uint64_t  em_timer_tick = 0;  // Last tick processed by em_timer_run()
+static int       em_timer_armed = 0;
+
+uint64_t em_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void em_timer_unlink(em_timer *timer) {
+    if (timer->prev) timer->prev->next = timer->next;
+    else em_timer_slots[timer->slot] = timer->next;
+    if (timer->next) timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    timer->armed = 0;
+    em_timer_armed--;
+}
+
+void em_timer_arm(em_timer *timer, uint64_t expires) {
+    if (!em_timer_tick) em_timer_tick = em_now_ms();
+    if (timer->armed) em_timer_unlink(timer);
+
+    // Already due timers go into the next slot to be processed.
+    uint64_t tick = expires > em_timer_tick ? expires : em_timer_tick + 1;
+
+    timer->expires = expires;
+    timer->slot = tick % EM_TIMER_SLOTS;
+    timer->prev = NULL;
+    timer->next = em_timer_slots[timer->slot];
+    if (timer->next) timer->next->prev = timer;
+    em_timer_slots[timer->slot] = timer;
+    timer->armed = 1;
+    em_timer_armed++;
+}
+
+void em_timer_cancel(em_timer *timer) {
+    if (timer->armed) em_timer_unlink(timer);
+}
+
+// Milliseconds until the next timer is due, capped at max_ms. Suitable as
+// poll() timeout.
+int em_timer_timeout(int max_ms) {
+    if (!em_timer_armed) return max_ms;
+
+    uint64_t now = em_now_ms();
+    uint64_t next = now + max_ms;
+    for (int i = 1; i <= EM_TIMER_SLOTS; i++) {
+        em_timer *timer = em_timer_slots[(em_timer_tick + i) % EM_TIMER_SLOTS];
+        while (timer) {
+            if (timer->expires < next) next = timer->expires;
+            timer = timer->next;
+        }
+        // Slots are visited in time order, nothing later can beat this.
+        if (next <= em_timer_tick + i) break;
+    }
+    return next > now ? (int)(next - now) : 0;
+}
+
+// Fire all timers that are due. Callbacks may re-arm or cancel timers.
+void em_timer_run() {
+    uint64_t now = em_now_ms();
+    if (!em_timer_tick) em_timer_tick = now;
+    if (!em_timer_armed) {
+        em_timer_tick = now;
+        return;
+    }
+
+    // After long gaps one full revolution covers every slot.
+    uint64_t tick = em_timer_tick;
+    if (now - tick > EM_TIMER_SLOTS) tick = now - EM_TIMER_SLOTS;
+
+    while (tick < now) {
+        tick++;
+        em_timer_tick = tick;
+
+        // Detach due timers first, callbacks are free to re-arm into this slot.
+        em_timer *due = NULL;
+        em_timer *timer = em_timer_slots[tick % EM_TIMER_SLOTS];
+        while (timer) {
+            em_timer *next = timer->next;
+            if (timer->expires <= now) {
+                em_timer_unlink(timer);
+                timer->next = due;
+                due = timer;
+            }
+            timer = next;
+        }
+
+        while (due) {
+            timer = due;
+            due = due->next;
+            timer->next = NULL;
+            timer->cb(timer);
+        }
+    }
+}
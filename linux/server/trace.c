@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "octopus-server.h"
+
+// Flight recorder ring. Only the main loop writes to it, recording is a
+// counter increment and a store. Timestamps come from the kernel for
+// device events, everything else reuses em_trace_now, which the main loop
+// refreshes once per wakeup.
+
+em_trace_rec em_trace_ring[EM_TRACE_RECORDS];
+uint64_t     em_trace_total = 0;
+uint64_t     em_trace_now = 0;
+
+static char  em_trace_path[EM_MAX_STR+1] = EM_TRACE_FILE;
+
+uint64_t em_trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    em_trace_now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return em_trace_now;
+}
+
+void em_trace_set_file(const char *path) {
+    snprintf(em_trace_path, sizeof(em_trace_path), "%s", path ? path : EM_TRACE_FILE);
+}
+
+// Write the ring to the trace file, oldest record first. Returns 0 on success.
+int em_trace_dump() {
+    em_trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EM_TRACE_MAGIC, sizeof(header.magic));
+    header.rec_size  = sizeof(em_trace_rec);
+    header.total     = em_trace_total;
+    header.num       = em_trace_total < EM_TRACE_RECORDS ? em_trace_total : EM_TRACE_RECORDS;
+    header.dumped_us = em_trace_clock();
+
+    int fd = open(em_trace_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    int ok = write(fd, &header, sizeof(header)) == sizeof(header);
+
+    // Oldest part first, from the write position up to the end, then the start.
+    uint32_t head  = em_trace_total & (EM_TRACE_RECORDS - 1);
+    uint32_t first = header.num < EM_TRACE_RECORDS ? 0 : head;
+    uint32_t num   = header.num - first;
+    if (ok && num)  ok = write(fd, &em_trace_ring[first], num * sizeof(em_trace_rec)) == num * sizeof(em_trace_rec);
+    if (ok && first) ok = write(fd, em_trace_ring, first * sizeof(em_trace_rec)) == first * sizeof(em_trace_rec);
+
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+const char *em_trace_file() {
+    return em_trace_path;
+}
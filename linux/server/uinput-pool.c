@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+#include "octopus-server.h"
+
+// Pool of uinput clones. A clone outlives the physical device it was
+// created for, so a device that drops out and comes back (wireless
+// receivers going to sleep) is rebound to the clone it had before instead
+// of having udev and the desktop enumerate a brand new input device.
+// Clones are keyed by vendor/product/name and a hash over the capabilities.
+
+em_clone *em_clone_pool = NULL;
+
+uint32_t em_clone_caps(struct libevdev *evdev) {
+    // FNV-1a over all supported properties, types and codes.
+    uint32_t hash = 2166136261u;
+    void add(uint32_t v) {
+        for (int i = 0; i < 4; i++) {
+            hash ^= (v >> (i * 8)) & 0xff;
+            hash *= 16777619u;
+        }
+    }
+
+    for (unsigned int p = 0; p < INPUT_PROP_CNT; p++) {
+        if (libevdev_has_property(evdev, p)) add(0x10000 | p);
+    }
+    for (unsigned int t = 0; t < EV_CNT; t++) {
+        if (!libevdev_has_event_type(evdev, t)) continue;
+        add(t << 16);
+        int max = libevdev_event_type_get_max(t);
+        for (int c = 0; c <= max; c++) {
+            if (libevdev_has_event_code(evdev, t, c)) add((t << 16) | c);
+        }
+    }
+    return hash;
+}
+
+static int em_clone_matches(em_clone *clone, struct libevdev *evdev, const char *name, uint32_t caps) {
+    if (clone->vendor_id  != (uint16_t)libevdev_get_id_vendor(evdev))  return 0;
+    if (clone->product_id != (uint16_t)libevdev_get_id_product(evdev)) return 0;
+    if (clone->caps != caps) return 0;
+    return strcmp(clone->name, name) == 0 ? 1 : 0;
+}
+
+// Returns an unbound clone matching evdev, or NULL. Must be called before
+// the evdev is renamed, the pool is keyed by the original device name.
+em_clone *em_clone_acquire(struct libevdev *evdev) {
+    const char *name = libevdev_get_name(evdev);
+    uint32_t caps = em_clone_caps(evdev);
+
+    em_clone *clone = em_clone_pool;
+    while (clone) {
+        if (!clone->bound && em_clone_matches(clone, evdev, name, caps)) {
+            clone->bound = 1;
+            return clone;
+        }
+        clone = clone->next;
+    }
+    return NULL;
+}
+
+// Hand a clone back to the pool. It stays alive for the next device with
+// the same identity. Keys still held on it are released first, the clone
+// would otherwise keep them pressed forever.
+void em_clone_release(em_clone *clone, struct libevdev *evdev) {
+    if (!clone) return;
+
+    if (evdev && libevdev_has_event_type(evdev, EV_KEY)) {
+        int released = 0;
+        for (int k = 0; k < KEY_CNT; k++) {
+            if (libevdev_get_event_value(evdev, EV_KEY, k)) {
+                libevdev_uinput_write_event(clone->uidev, EV_KEY, k, 0);
+                released++;
+            }
+        }
+        if (released) libevdev_uinput_write_event(clone->uidev, EV_SYN, SYN_REPORT, 0);
+    }
+
+    clone->bound = 0;
+}
+
+typedef struct em_clone_job_type {
+    struct libevdev        *evdev;
+    em_clone               *clone;
+    pthread_t               thread;
+    int                     threaded;
+} em_clone_job;
+
+static void *em_clone_create_job(void *arg) {
+    em_clone_job *job = arg;
+    em_clone *clone = job->clone;
+
+    clone->uifd = open("/dev/uinput", O_RDWR);
+    if (clone->uifd < 0 || libevdev_uinput_create_from_device(job->evdev, clone->uifd, &(clone->uidev)) != 0) {
+        if (clone->uifd >= 0) close(clone->uifd);
+        clone->uifd = 0;
+        clone->uidev = NULL;
+    }
+    return NULL;
+}
+
+// Create new clones for evdevs[0..num-1], in parallel when there is more
+// than one. names[] holds the original device names used as pool keys.
+// clones[i] is set to the new, bound clone or NULL on failure.
+void em_clone_create_all(struct libevdev **evdevs, char **names, em_clone **clones, int num) {
+    em_clone_job *jobs = em_malloc(num * sizeof(em_clone_job));
+
+    for (int i = 0; i < num; i++) {
+        jobs[i].evdev = evdevs[i];
+        jobs[i].clone = em_malloc(sizeof(em_clone));
+        jobs[i].clone->vendor_id  = (uint16_t)libevdev_get_id_vendor(evdevs[i]);
+        jobs[i].clone->product_id = (uint16_t)libevdev_get_id_product(evdevs[i]);
+        jobs[i].clone->caps       = em_clone_caps(evdevs[i]);
+        jobs[i].clone->name       = strdup(names[i]);
+        if (!jobs[i].clone->name) em_fatal("strdup() failed");
+
+        // Fall back to creating the clone inline if we can't get a thread.
+        if (num > 1 && pthread_create(&(jobs[i].thread), NULL, em_clone_create_job, &jobs[i]) == 0)
+            jobs[i].threaded = 1;
+        else
+            em_clone_create_job(&jobs[i]);
+    }
+
+    for (int i = 0; i < num; i++) {
+        if (jobs[i].threaded) pthread_join(jobs[i].thread, NULL);
+
+        em_clone *clone = jobs[i].clone;
+        if (!clone->uidev) {
+            free(clone->name);
+            free(clone);
+            clones[i] = NULL;
+            continue;
+        }
+
+        clone->bound = 1;
+        clone->next = em_clone_pool;
+        em_clone_pool = clone;
+        clones[i] = clone;
+    }
+
+    free(jobs);
+}
+
+// Destroy unbound clones no entry of config would ever take again, after a
+// reload removed or changed the entries they were made for. Entries are
+// matched by IDs and name like em_grab_devices() does. check_capability
+// can't be checked without the node, such clones are kept.
+void em_clone_prune(em_config *config) {
+    em_clone **link = &em_clone_pool;
+    while (*link) {
+        em_clone *clone = *link;
+        char vendor[8], product[8];
+        int wanted = clone->bound;
+
+        snprintf(vendor, sizeof(vendor), "%04x", clone->vendor_id);
+        snprintf(product, sizeof(product), "%04x", clone->product_id);
+        for (int d = 0; d < config->num_devices && !wanted; d++) {
+            em_device_info *info = config->devices[d].info;
+            if (config->devices[d].node != 0) continue;
+            if (fnmatch(info->vendor_id, vendor, 0) != 0) continue;
+            if (fnmatch(info->product_id, product, 0) != 0) continue;
+            if (info->name && fnmatch(info->name, clone->name, 0) != 0) continue;
+            wanted = 1;
+        }
+        if (wanted) {
+            link = &clone->next;
+            continue;
+        }
+
+        printf("Destroying uinput clone of %s (%s:%s)\n", clone->name, vendor, product);
+        *link = clone->next;
+        libevdev_uinput_destroy(clone->uidev);
+        close(clone->uifd);
+        free(clone->name);
+        free(clone);
+    }
+}
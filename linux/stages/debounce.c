@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <octopus-stage.h>
+
+// Example stage: debounces keys and buttons that chatter. A press coming
+// less than "ms" after the release of the same key on the same event node
+// is dropped, together with its repeats and its release. Times are the
+// kernel's event timestamps. Frames left with nothing but their
+// SYN_REPORT are dropped as a whole.
+//
+//   "stages": [ { "plugin": "/usr/lib/octopus/octopus-debounce.so", "args": { "ms": 15 } } ]
+
+#define DEFAULT_MS  10
+#define MAX_NODES   32
+
+typedef struct {
+    uint32_t device;
+    uint32_t node;
+    uint64_t released_us[KEY_CNT];
+    uint8_t  bouncing[KEY_CNT / 8];
+} node_state;
+
+typedef struct {
+    uint64_t   window_us;
+    int        num_nodes;
+    node_state nodes[MAX_NODES];
+} debounce_state;
+
+// Accepts { "ms": N } or just N.
+static int debounce_init(const char *args, void **state) {
+    const char *ms_arg = strstr(args, "\"ms\"");
+    char *end;
+    long ms = DEFAULT_MS;
+
+    if (ms_arg) {
+        ms_arg = strchr(ms_arg, ':');
+        if (!ms_arg) return -1;
+        ms = strtol(ms_arg + 1, &end, 10);
+    }
+    else if (args[0]) {
+        ms = strtol(args, &end, 10);
+        if (*end) return -1;
+    }
+    if (ms < 0) return -1;
+
+    debounce_state *s = calloc(1, sizeof(debounce_state));
+    if (!s) return -1;
+    s->window_us = ms * 1000;
+    *state = s;
+    return 0;
+}
+
+static node_state *node_for(debounce_state *s, octopus_frame *frame) {
+    for (int n = 0; n < s->num_nodes; n++) {
+        if (s->nodes[n].device == frame->device && s->nodes[n].node == frame->node) return &s->nodes[n];
+    }
+    if (s->num_nodes == MAX_NODES) return NULL;
+    node_state *ns = &s->nodes[s->num_nodes++];
+    ns->device = frame->device;
+    ns->node   = frame->node;
+    return ns;
+}
+
+static void debounce_process(void *state, octopus_frame *frame) {
+    node_state *ns = node_for(state, frame);
+    uint64_t window_us = ((debounce_state *)state)->window_us;
+    uint32_t kept = 0, dropped = 0, syn_only = 1;
+    if (!ns) return;
+
+    for (uint32_t e = 0; e < frame->num; e++) {
+        struct input_event *ie = &frame->events[e];
+
+        if (ie->type == EV_KEY && ie->code < KEY_CNT) {
+            uint8_t bit = 1 << (ie->code & 7);
+            uint8_t *bouncing = &ns->bouncing[ie->code >> 3];
+            uint64_t now_us = (uint64_t)ie->time.tv_sec * 1000000 + ie->time.tv_usec;
+
+            if (ie->value == 1 && ns->released_us[ie->code]
+                && now_us - ns->released_us[ie->code] < window_us)
+                *bouncing |= bit;
+            if (*bouncing & bit) {
+                if (ie->value == 0) *bouncing &= ~bit;
+                dropped++;
+                continue;
+            }
+            if (ie->value == 0) ns->released_us[ie->code] = now_us;
+        }
+
+        if (ie->type != EV_SYN) syn_only = 0;
+        if (kept != e) frame->events[kept] = *ie;
+        kept++;
+    }
+
+    frame->num = (dropped && syn_only) ? 0 : kept;
+}
+
+static void debounce_destroy(void *state) {
+    free(state);
+}
+
+static const octopus_stage_ops debounce_ops = {
+    .abi     = OCTOPUS_STAGE_ABI,
+    .name    = "debounce",
+    .init    = debounce_init,
+    .process = debounce_process,
+    .destroy = debounce_destroy,
+};
+
+const octopus_stage_ops *octopus_stage(void) {
+    return &debounce_ops;
+}
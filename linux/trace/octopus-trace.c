@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <libevdev/libevdev.h>
+
+#include "octopus-trace.h"
+
+// Prints a flight recorder dump written by octopus-server on SIGUSR2 or
+// on a fatal error.
+
+static void show_usage(const char *arg0)
+{
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Usage: %s [-n <records>] [<traceFile>]\n", arg0);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         Decodes a trace dumped by octopus-server, default file is\n");
+  fprintf(stderr, "         %s.\n", EM_TRACE_FILE);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "         -n <records> : Only print the last <records> records.\n");
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+static const char *kind_name(int kind)
+{
+  switch (kind) {
+  case EM_TRACE_EVENT:   return "event";
+  case EM_TRACE_TIMED:   return "timed";
+  case EM_TRACE_FILTER:  return "filter";
+  case EM_TRACE_MAPPING: return "mapping";
+  case EM_TRACE_SWITCH:  return "switch";
+  case EM_TRACE_SEND:    return "send";
+  case EM_TRACE_DROP:    return "drop";
+  case EM_TRACE_ERROR:   return "error";
+  case EM_TRACE_MARK:    return "mark";
+  }
+  return "?";
+}
+
+static const char *mark_name(int code)
+{
+  switch (code) {
+  case EM_TRACE_MARK_GRAB:    return "device scan";
+  case EM_TRACE_MARK_RELOAD:  return "config reloaded";
+  case EM_TRACE_MARK_FATAL:   return "fatal error";
+  case EM_TRACE_MARK_DUMP:    return "dump requested";
+  case EM_TRACE_MARK_RELEASE: return "held keys released";
+  }
+  return "?";
+}
+
+static const char *filter_reason(int aux)
+{
+  switch (aux) {
+  case EM_TRACE_FILTER_COMBO:    return "combo";
+  case EM_TRACE_FILTER_DEVICE:   return "device drop_events";
+  case EM_TRACE_FILTER_CLIENT:   return "client drop_events";
+  case EM_TRACE_FILTER_INJECTED: return "injected release";
+  }
+  return "?";
+}
+
+static const char *drop_reason(int aux)
+{
+  switch (aux) {
+  case EM_TRACE_DROP_ABSENT:   return "client absent";
+  case EM_TRACE_DROP_OVERFLOW: return "queue overflow";
+  case EM_TRACE_DROP_EMPTY:    return "empty frame";
+  }
+  return "?";
+}
+
+static void print_event(em_trace_rec *rec)
+{
+  const char *type = libevdev_event_type_get_name(rec->type);
+  const char *code = libevdev_event_code_get_name(rec->type, rec->code);
+
+  if (rec->type == EV_KEY && rec->code >= 0x400 && rec->code <= 0x403) {
+    static const char *wheel[] = { "WHEEL_UP", "WHEEL_RIGHT", "WHEEL_DOWN", "WHEEL_LEFT" };
+    code = wheel[rec->code - 0x400];
+  }
+
+  if (type) printf(" %s", type);
+  else printf(" type %u", rec->type);
+  if (code) printf(" %s", code);
+  else printf(" code %u", rec->code);
+  printf(" %d", rec->value);
+}
+
+int main(int argc, char*argv[]) {
+  const char *fname = EM_TRACE_FILE;
+  long last = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n':
+      last = atol(optarg);
+      if (last <= 0) show_usage(argv[0]);
+      break;
+    default:
+      show_usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1) show_usage(argv[0]);
+  if (optind == argc - 1) fname = argv[optind];
+
+  FILE *f = fopen(fname, "rb");
+  if (!f) {
+    fprintf(stderr, "Unable to open %s\n", fname);
+    exit(-1);
+  }
+
+  em_trace_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, EM_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s is not an octopus trace\n", fname);
+    exit(-1);
+  }
+  if (header.rec_size != sizeof(em_trace_rec)) {
+    fprintf(stderr, "%s has %u byte records, expected %zu\n", fname, header.rec_size, sizeof(em_trace_rec));
+    exit(-1);
+  }
+
+  printf("%u of %llu records, dumped at %llu.%06llu\n", header.num, (unsigned long long)header.total,
+    (unsigned long long)(header.dumped_us / 1000000), (unsigned long long)(header.dumped_us % 1000000));
+
+  if (last && last < header.num) fseek(f, (header.num - last) * sizeof(em_trace_rec), SEEK_CUR);
+
+  // Times are printed relative to the dump.
+  em_trace_rec rec;
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    printf("%+12.6f %-7s", ((double)rec.time_us - (double)header.dumped_us) / 1e6, kind_name(rec.kind));
+
+    if (rec.dev != EM_TRACE_NO_DEV) printf(" dev #%u", rec.dev);
+    if (rec.client != EM_TRACE_NO_CLIENT) printf(" client #%u", rec.client);
+
+    switch (rec.kind) {
+    case EM_TRACE_MARK:
+      printf(" %s", mark_name(rec.code));
+      if (rec.code == EM_TRACE_MARK_RELEASE) printf(" (%d)", rec.aux);
+      break;
+    case EM_TRACE_SWITCH:
+      printf(" from client #%d", rec.aux);
+      break;
+    case EM_TRACE_MAPPING:
+      print_event(&rec);
+      printf(" mapping #%d", rec.aux);
+      break;
+    case EM_TRACE_EVENT:
+      print_event(&rec);
+      if (rec.aux == LIBEVDEV_READ_STATUS_SYNC) printf(" (resync)");
+      break;
+    case EM_TRACE_ERROR:
+      print_event(&rec);
+      printf(" error %d", rec.aux);
+      break;
+    case EM_TRACE_FILTER:
+      print_event(&rec);
+      printf(" (%s)", filter_reason(rec.aux));
+      break;
+    case EM_TRACE_DROP:
+      print_event(&rec);
+      printf(" (%s)", drop_reason(rec.aux));
+      break;
+    default:
+      print_event(&rec);
+    }
+    printf("\n");
+  }
+
+  fclose(f);
+  return 0;
+}
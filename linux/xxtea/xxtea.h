@@ -18,6 +18,7 @@
 #define XXTEA_INCLUDED
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,6 +48,56 @@ void * xxtea_encrypt(const void * data, size_t len, const void * key, size_t * o
  */
 void * xxtea_decrypt(const void * data, size_t len, const void * key, size_t * out_len);
 
+/* Longest block xxtea_encrypt_blocks/xxtea_decrypt_blocks take, in words */
+#define XXTEA_MAX_WORDS 32
+
+/**
+ * Function: xxtea_fix_key
+ * @key:     Symmetric key, as passed to xxtea_encrypt
+ * @out:     4 words receiving the key as the block functions take it
+ */
+void xxtea_fix_key(const void * key, uint32_t * out);
+
+/**
+ * Function: xxtea_encrypt_blocks
+ * @data:    @num blocks of @words 32 bit words each, encrypted in place
+ * @words:   Block length, 2 to XXTEA_MAX_WORDS
+ * @num:     Number of blocks
+ * @keys:    4 words per block, see xxtea_fix_key
+ *
+ * Independent blocks are processed in parallel vector lanes. A block
+ * laid out like xxtea_encrypt lays out its input, the data as little
+ * endian words followed by the data length in bytes, encrypts to the
+ * same bytes xxtea_encrypt returns.
+ */
+void xxtea_encrypt_blocks(uint32_t * data, size_t words, size_t num, const uint32_t * keys);
+
+/**
+ * Function: xxtea_decrypt_blocks
+ * @data:    @num blocks of @words 32 bit words each, decrypted in place
+ * @words:   Block length, 2 to XXTEA_MAX_WORDS
+ * @num:     Number of blocks
+ * @keys:    4 words per block, see xxtea_fix_key
+ *
+ * The last word of a block decrypted from xxtea_encrypt output holds the
+ * data length, callers check it like xxtea_decrypt does.
+ */
+void xxtea_decrypt_blocks(uint32_t * data, size_t words, size_t num, const uint32_t * keys);
+
+/**
+ * Function: xxtea_batch_impl
+ * Returns:  Name of the block implementation in use, picked for the CPU
+ *           on first use: "avx2", "sse2", "vector" or "scalar"
+ */
+const char * xxtea_batch_impl(void);
+
+/**
+ * Function: xxtea_batch_force
+ * @name:    Implementation to use from now on, see xxtea_batch_impl
+ * Returns:  0 if it isn't available on this CPU
+ */
+int xxtea_batch_force(const char * name);
+
 #ifdef __cplusplus
 }
 #endif